@@ -274,7 +274,15 @@ local function flush(lpack)
     local writeQ = lpack.writeQ
     local count = #writeQ
     if count then
-        local str = lpack.serialize_write_Q(writeQ, lpack.writeQsize)
+        local outBuffer = lpack.outBuffer
+        local str
+        if (outBuffer) then
+            -- serialized straight into the output buffer, writeFn is just told that it has grown
+            lpack.serialize_write_Q(writeQ, lpack.writeQsize, outBuffer)
+            str = outBuffer
+        else
+            str = lpack.serialize_write_Q(writeQ, lpack.writeQsize)
+        end
         if str then
             lpack:writeFn(str)
             lpack.writeQsize = 0
@@ -430,7 +438,7 @@ local function newLPackWriter(limit)
     local lpackWriter = luaw_lpack_lib.newLPackParser()
     lpackWriter.writeQ = {}
     lpackWriter.writeQsize = 0
-    lpackWriter.flushLimit = limit or luaw_constants.CONN_BUFFER_SIZE
+    lpackWriter.flushLimit = limit or luaw_constants.STREAMING_FLUSH_THRESHOLD
     lpackWriter.useDictionary = setDictionaryForWrite
     lpackWriter.write = write
     return lpackWriter
@@ -459,8 +467,11 @@ local function newLPackRespWriter(resp, limit)
     local lpackWriter = newLPackWriter(limit)
     resp.headers['Content-Type'] = 'application/luapack'
     resp:startStreaming()
-    lpackWriter.writeFn = function(lpack, str)
-        resp:appendBody(str)
+    lpackWriter.outBuffer = resp.bodyParts
+    lpackWriter.writeFn = function(lpack)
+        -- content is already in response's body buffer, appending nothing lets response send it
+        -- out once it is over the flush threshold
+        resp:appendBody("")
     end
     return lpackWriter
 end
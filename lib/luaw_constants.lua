@@ -35,6 +35,31 @@ return {
     DEFAULT_WRITE_TIMEOUT = luaw_server_config.write_timeout or 3000,
     CONN_BUFFER_SIZE = luaw_server_config.connection_buffer_size or 4096,
 
+    -- HTTP client constants
+    DEFAULT_UPSTREAM_MAX_IN_FLIGHT = luaw_server_config.upstream_max_in_flight, -- nil = no limit
+    DEFAULT_UPSTREAM_QUEUE_TIMEOUT = luaw_server_config.upstream_queue_timeout, -- nil = wait forever
+    UPSTREAM_LIMITS = luaw_server_config.upstream_limits or {},
+    PIPELINE_DEPTH = luaw_server_config.pipeline_depth or 8,
+    REDIS_POOL_SIZE = luaw_server_config.redis_pool_size or 1,
+    -- lazy headers and params rely on __pairs metamethod which Lua 5.1 does not support
+    LAZY_HEADERS = (luaw_server_config.lazy_headers ~= false)and(_VERSION ~= "Lua 5.1"),
+    -- request bodies bigger than this are spooled to a temp file, nil = always keep them in memory
+    BODY_SPOOL_THRESHOLD = luaw_server_config.body_spool_threshold,
+    BODY_SPOOL_DIR = luaw_server_config.body_spool_dir or "/tmp",
+    -- dispatch pipelined requests on the same connection concurrently, responses are still sent in order
+    SERVER_PIPELINING = (luaw_server_config.server_pipelining == true),
+    SERVER_PIPELINE_DEPTH = luaw_server_config.server_pipeline_depth or 8,
+    -- streamed response body is sent as a chunk whenever this much of it is buffered
+    STREAMING_FLUSH_THRESHOLD = luaw_server_config.streaming_flush_threshold or luaw_server_config.connection_buffer_size or 4096,
+    -- ETag header computed from response body and 304 response to matching If-None-Match, off by default
+    ETAGS = (luaw_server_config.etags == true),
+    -- gzip/deflate compression of responses, off by default
+    COMPRESSION = (luaw_server_config.compression == true),
+    COMPRESSION_LEVEL = luaw_server_config.compression_level or 6,
+    COMPRESSION_MIN_SIZE = luaw_server_config.compression_min_size or 1024,
+    COMPRESSION_TYPES = luaw_server_config.compression_types or {"text/html", "text/plain", "text/css",
+        "text/xml", "text/javascript", "application/javascript", "application/json", "application/xml"},
+
     -- HTTP parser constants
     EOF = 0,
     CRLF = '\r\n',
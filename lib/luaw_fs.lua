@@ -0,0 +1,165 @@
+--[[
+Copyright (c) 2015 raksoras
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+]]
+
+local constants = require('luaw_constants')
+local scheduler = require('luaw_scheduler')
+
+local TS_BLOCKED_EVENT = constants.TS_BLOCKED_EVENT
+
+local openInternal = luaw_fs_lib.open
+local writeInternal = luaw_fs_lib.write
+local readInternal = luaw_fs_lib.read
+local sizeInternal = luaw_fs_lib.size
+local closeInternal = luaw_fs_lib.close
+local unlinkInternal = luaw_fs_lib.unlink
+
+-- blocks calling thread till libuv completes file request started by the internal call
+local function await(status, mesg)
+    assert(status, mesg)
+    status, mesg = coroutine.yield(TS_BLOCKED_EVENT)
+    assert(status, mesg)
+    return mesg
+end
+
+local function open(path, mode)
+    return await(openInternal(path, mode or "r", scheduler.tid()))
+end
+
+local function write(fd, str, offset, i, j)
+    return await(writeInternal(fd, str, offset or -1, scheduler.tid(), i, j))
+end
+
+local function read(fd, len, offset)
+    return await(readInternal(fd, len, offset or -1, scheduler.tid()))
+end
+
+local function size(fd)
+    return await(sizeInternal(fd, scheduler.tid()))
+end
+
+local function close(fd)
+    return await(closeInternal(fd, scheduler.tid()))
+end
+
+local function unlink(path)
+    return await(unlinkInternal(path, scheduler.tid()))
+end
+
+-- file object, reads are sequential from the start of the file, writes always append
+
+local fileMT = {}
+fileMT.__index = fileMT
+
+-- writes str or just string.sub(str, i, j) if i and j are given
+function fileMT:write(str, i, j)
+    i = i or 1
+    j = j or #str
+    local offset = self.size
+    while (i <= j) do
+        local nwritten = write(self.fd, str, offset, i, j)
+        offset = offset + nwritten
+        i = i + nwritten
+    end
+    self.size = offset
+end
+
+-- returns next chunk of at most len bytes, nil at the end of file
+function fileMT:read(len)
+    if (self.readOffset >= self.size) then return end
+    local chunk = read(self.fd, len, self.readOffset)
+    if (#chunk == 0) then return end
+    self.readOffset = self.readOffset + #chunk
+    return chunk
+end
+
+function fileMT:rewind()
+    self.readOffset = 0
+end
+
+-- iterates over the file content in chunks, from the start of the file
+function fileMT:chunks(len)
+    self:rewind()
+    return function()
+        return self:read(len)
+    end
+end
+
+function fileMT:readAll()
+    local parts = {}
+    for chunk in self:chunks() do
+        table.insert(parts, chunk)
+    end
+    return table.concat(parts)
+end
+
+function fileMT:close()
+    local fd = self.fd
+    if (fd) then
+        self.fd = nil
+        close(fd)
+    end
+end
+
+local function newFile(fd, path, fileSize)
+    return setmetatable({fd = fd, path = path, size = fileSize or 0, readOffset = 0}, fileMT)
+end
+
+local function openFile(path, mode)
+    local fd = open(path, mode)
+    return newFile(fd, path, size(fd))
+end
+
+local tempFileCount = 0
+
+-- Opens new read/write file in dir that is deleted right away. File lives on only as long as it is
+-- open, which means it never outlives the process even if it is never closed.
+local function tempFile(dir)
+    while true do
+        tempFileCount = tempFileCount + 1
+        local path = string.format("%s/luaw-%d-%d-%d.tmp", dir, os.time(), math.random(1000000), tempFileCount)
+        local status, fd = openInternal(path, "x+", scheduler.tid())
+        if (status) then
+            status, fd = coroutine.yield(TS_BLOCKED_EVENT)
+        end
+        if (status) then
+            unlink(path)
+            return newFile(fd, path, 0)
+        end
+        if (not tostring(fd):find("exists")) then
+            error(fd)
+        end
+    end
+end
+
+luaw_fs_lib.open = open
+luaw_fs_lib.write = write
+luaw_fs_lib.read = read
+luaw_fs_lib.size = size
+luaw_fs_lib.close = close
+luaw_fs_lib.unlink = unlink
+luaw_fs_lib.openFile = openFile
+luaw_fs_lib.tempFile = tempFile
+luaw_fs_lib.isFile = function(obj)
+    return (getmetatable(obj) == fileMT)
+end
+
+return luaw_fs_lib
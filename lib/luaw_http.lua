@@ -21,12 +21,27 @@ SOFTWARE.
 ]]
 
 local constants = require('luaw_constants')
+local scheduler = require('luaw_scheduler')
 local luaw_tcp_lib = require('luaw_tcp')
+local luaw_timer_lib = require('luaw_timer')
+local luaw_fs_lib = require('luaw_fs')
 
 local TS_BLOCKED_EVENT = constants.TS_BLOCKED_EVENT
 local TS_RUNNABLE = constants.TS_RUNNABLE
 
-local CONN_BUFFER_SIZE = constants.CONN_BUFFER_SIZE
+local STREAMING_FLUSH_THRESHOLD = constants.STREAMING_FLUSH_THRESHOLD
+local ETAGS = constants.ETAGS
+local COMPRESSION = constants.COMPRESSION
+local COMPRESSION_LEVEL = constants.COMPRESSION_LEVEL
+local COMPRESSION_MIN_SIZE = constants.COMPRESSION_MIN_SIZE
+local COMPRESSION_TYPES = constants.COMPRESSION_TYPES
+local DEFAULT_UPSTREAM_MAX_IN_FLIGHT = constants.DEFAULT_UPSTREAM_MAX_IN_FLIGHT
+local DEFAULT_UPSTREAM_QUEUE_TIMEOUT = constants.DEFAULT_UPSTREAM_QUEUE_TIMEOUT
+local UPSTREAM_LIMITS = constants.UPSTREAM_LIMITS
+local PIPELINE_DEPTH = constants.PIPELINE_DEPTH
+local LAZY_HEADERS = constants.LAZY_HEADERS
+local BODY_SPOOL_THRESHOLD = constants.BODY_SPOOL_THRESHOLD
+local BODY_SPOOL_DIR = constants.BODY_SPOOL_DIR
 
 local EOF = constants.EOF
 local CRLF = constants.CRLF
@@ -79,66 +94,136 @@ local http_status_codes = {
     [505] = "HTTP Version Not Supported"
 }
 
+-- status lines for these are pre-rendered in C
+luaw_http_lib.setStatusMessages(http_status_codes)
+
 setmetatable(http_status_codes, {
     __index = function(status)
         return "User Defined Status"
     end
 })
 
--- write buffer implementation
+-- write buffers are C string builders that can be handed to conn:write() as is, see luaw_buffer.c
+local newBuffer = luaw_buffer_lib.newBuffer
 
-local function clearArrayPart(t)
-    local len = #t
-    for i=1,len do
-        t[i] = nil
-    end
-end
+local canonicalHeaderName = luaw_http_lib.canonicalHeaderName
+
+-- headers tables support case insensitive lookup: headers['content-type'] finds 'Content-Type'
+local headersMT = { __index = luaw_http_lib.getHeader }
 
-local function reset(buffer)
-    clearArrayPart(buffer)
-    buffer.len = 0
+local function newHeaders()
+    return setmetatable({}, headersMT)
 end
 
-local function concat(buffer)
-    return table.concat(buffer)
+--[[ Lazy headers and params: most handlers look at only a few of the request headers and query
+params. Instead of decoding all of them upfront, parser hands us an index of header offsets into
+the raw request buffer, and we keep the query string around. req.headers and req.params are proxy
+tables that decode and cache an entry on first access. Iterating over them or modifying them
+materializes the full table, after which they behave as regular tables.
+]]
+local getHeader = luaw_http_lib.getHeader
+local urlDecodeParam = luaw_http_lib.urlDecodeParam
+local checkUrlEncoding = luaw_http_lib.checkUrlEncoding
+local lazyIndexes = setmetatable({}, { __mode = 'k' })
+
+local function materializeHeaders(headers)
+    local index = lazyIndexes[headers]
+    if (index) then
+        lazyIndexes[headers] = nil
+        index:materialize(headers)
+        setmetatable(headers, headersMT)
+    end
 end
 
-local function append(buffer, str)
-    local len = buffer.len
-    if (str) then
-        table.insert(buffer, str)
-        len = len + #str
-        buffer.len = len
+local lazyHeadersMT = {
+    __index = function(headers, name)
+        local index = lazyIndexes[headers]
+        if (not index) then
+            return getHeader(headers, name)
+        end
+        if (type(name) ~= 'string') then
+            return nil
+        end
+
+        local canonical = canonicalHeaderName(name)
+        if (canonical ~= name) then
+            local value = rawget(headers, canonical)
+            if (value ~= nil) then
+                return value
+            end
+        end
+
+        local value, storedName = index:get(name)
+        if (value ~= nil) then
+            rawset(headers, storedName, value)
+        end
+        return value
+    end,
+
+    __newindex = function(headers, name, value)
+        materializeHeaders(headers)
+        rawset(headers, name, value)
+    end,
+
+    __pairs = function(headers)
+        materializeHeaders(headers)
+        return next, headers, nil
     end
-    return len
+}
+
+local function newLazyHeaders(index)
+    local headers = setmetatable({}, lazyHeadersMT)
+    lazyIndexes[headers] = index
+    return headers
 end
 
-local function newBuffer()
-    return {
-        len = 0,
-        reset = reset,
-        concat = concat,
-        append = append
-    }
+local lazyQueries = setmetatable({}, { __mode = 'k' })
+
+local function materializeParams(params)
+    local queryString = lazyQueries[params]
+    if (queryString) then
+        lazyQueries[params] = nil
+        setmetatable(params, nil)
+        local decoded = {}
+        assert(luaw_http_lib:urlDecode(queryString, decoded))
+        for name, value in pairs(decoded) do
+            if (rawget(params, name) == nil) then
+                rawset(params, name, value)
+            end
+        end
+    end
 end
 
+local lazyParamsMT = {
+    __index = function(params, name)
+        local queryString = lazyQueries[params]
+        if ((queryString)and(type(name) == 'string')) then
+            local value = urlDecodeParam(queryString, name)
+            if (value ~= nil) then
+                rawset(params, name, value)
+            end
+            return value
+        end
+    end,
 
-function luaw_http_lib.storeHttpParam(params, name , value)
-	oldValue = params[name]
-    if (oldValue) then
-		-- handle multi-valued param names
-        if (type(oldValue) == 'table') then
-        	table.insert(oldValue, value)
-        else
-        	-- single param value already stored against the same param name
-			-- convert it to table and store multiple values in it
-			params[name] = {oldValue, value}
-		end
-	else
-		params[name] = value
-	end
+    __newindex = function(params, name, value)
+        materializeParams(params)
+        rawset(params, name, value)
+    end,
+
+    __pairs = function(params)
+        materializeParams(params)
+        return next, params, nil
+    end
+}
+
+local function newLazyParams(queryString)
+    local params = setmetatable({}, lazyParamsMT)
+    lazyQueries[params] = queryString
+    return params
 end
 
+
 local parserMT = getmetatable(luaw_http_lib.newHttpRequestParser())
 
 --[[ HTTP parser we use can invoke callback for the same HTTP field (status, URL, header
@@ -149,6 +234,10 @@ multiple chuncks - either of a fixed byte buffer size of by new lines. For this
 /_acc_header_value_) and then store full header value against full header name when the
 parser issues callback for a next HTTP field. Other fields like URL, status etc. are
 accumulated by concatenating them "in place".
+
+readAndParse() uses parser's batch mode (parseHttpBatch) which does all of the above in C, using
+the same hidden fields for header fragments that span multiple reads. The Lua callbacks below for
+URL, status and headers are only used with the plain, callback per field parseHttp() mode.
 ]]
 
 
@@ -163,6 +252,8 @@ end
 
 local function addHeader(req, hName, hValue)
 	if (hName and hValue) then
+		-- well known headers are always stored under their canonical names, see luaw_http_lib.getHeader
+		hName = canonicalHeaderName(hName)
 		local headers = req.headers
 		local currValues = headers[hName]
 
@@ -195,8 +286,10 @@ end
 
 local function handleKeepAlive(req, keepAlive)
     if not keepAlive then
+        -- message is still to be served, connection is closed after it. req.EOF is only set when
+        -- peer has closed the connection
         req.headers['Connection'] = 'close'
-        req.EOF = true
+        req.luaw_close_conn = true
     end
 end
 
@@ -205,6 +298,7 @@ end
 
 local function onMesgBegin(req, cbtype, remaining)
     req:reset()
+    req.luaw_mesg_begun = true
 end
 
 local function onStatus(req, cbtype, remaining ,status)
@@ -225,7 +319,10 @@ local function onHeaderValue(req, cbtype, remaining, hValue)
 	accumulateChunkedValue(req, '_acc_header_value_', hValue)
 end
 
-local function onHeadersComplete(req, cbtype, remaining, keepAlive, httpMajor, httpMinor, method, status)
+local function onHeadersComplete(req, cbtype, remaining, keepAlive, httpMajor, httpMinor, method, status, headerIndex)
+	if (headerIndex) then
+	    req.headers = newLazyHeaders(headerIndex)
+	end
 	handleAccHttpHeader(req)
 	handleKeepAlive(req, keepAlive)
 	req.major_version = httpMajor
@@ -245,18 +342,47 @@ local function onHeadersComplete(req, cbtype, remaining, keepAlive, httpMajor, h
     req.parsedURL = parsedURL
 
     -- GET query params
-    local params = {}
+    local params
     local queryString = parsedURL.queryString
-    if queryString then
-        assert(luaw_http_lib:urlDecode(queryString, params))
+    if ((queryString)and(LAZY_HEADERS)) then
+        -- malformed query string still fails the request right away, only decoding is deferred
+        assert(checkUrlEncoding(queryString))
+        params = newLazyParams(queryString)
+    else
+        params = {}
+        if queryString then
+            assert(luaw_http_lib:urlDecode(queryString, params))
+        end
     end
     req.params = params
 
     req.luaw_headers_done = true
 end
 
+local function isFormPost(req)
+    local contentType = req.headers['Content-Type']
+    return ((contentType)and(contentType:lower() == 'application/x-www-form-urlencoded'))
+end
+
+-- writes body buffered so far to the request's temp file, opening one if necessary
+local function spoolBody(req)
+    local bodyFile = req.luaw_body_file
+    if (not bodyFile) then
+        bodyFile = luaw_fs_lib.tempFile(BODY_SPOOL_DIR)
+        req.luaw_body_file = bodyFile
+    end
+    local bodyParts = req.bodyParts
+    if (bodyParts.len > 0) then
+        bodyFile:write(bodyParts:concat())
+        bodyParts:reset()
+    end
+end
+
 local function onBody(req, cbtype, remaining, chunk)
-    req.bodyParts:append(chunk)
+    local len = req.bodyParts:append(chunk)
+    if ((req.luaw_spool_body)and(len >= BODY_SPOOL_THRESHOLD)) then
+        spoolBody(req)
+    end
 end
 
 local function onMesgComplete(req, cbtype, remaining, keepAlive)
@@ -270,14 +396,20 @@ local function onMesgComplete(req, cbtype, remaining, keepAlive)
     end
 
     -- store body
-    local bodyParts = req.bodyParts
-    req.body = bodyParts:concat()
-    bodyParts:reset()
+    if (req.luaw_body_file) then
+        spoolBody(req)
+        req.body = req.luaw_body_file
+    else
+        local bodyParts = req.bodyParts
+        req.body = bodyParts:concat()
+        bodyParts:reset()
+    end
 
     -- POST form params
     local params = req.params
-    local contentType = req.headers['Content-Type']
-    if ((contentType) and (contentType:lower() == 'application/x-www-form-urlencoded')) then
+    if (isFormPost(req)) then
+        -- query params must be in place before body params are merged with them
+        materializeParams(params)
         assert(luaw_http_lib:urlDecode(req.body, params))
     end
 
@@ -300,9 +432,14 @@ local http_callbacks_lua = {
 local function parseHttpFragment(req, conn, parser, content, offset)
     -- matched against most number of return results possible. Actual variable names
     -- are meaningless without the context of correct callback, misleading even!
-    local cbtype, offset, keepAlive, httpMajor, httpMinor, method, status = parser:parseHttp(content, offset)
+    -- URL, status and headers are stored in req directly by the parser, we only get called back for
+    -- headers complete, body and message complete events
+    local cbtype, offset, keepAlive, httpMajor, httpMinor, method, status, headerIndex, mesgComplete = parser:parseHttpBatch(content, offset, req, LAZY_HEADERS)
     if (not cbtype) then
-        conn:close()
+        if (not req.luaw_reject_status) then
+            -- pipelined request over the limits is answered through the response queue first
+            conn:close()
+        end
         return error(offset) -- offset carries error message in this case
     end
 
@@ -312,7 +449,11 @@ local function parseHttpFragment(req, conn, parser, content, offset)
         return error("Invalid HTTP parser callback# "..tostring(cbtype).." requested")
     end
 
-    callback(req, cbtype, remaining, keepAlive, httpMajor, httpMinor, method, status)
+    callback(req, cbtype, remaining, keepAlive, httpMajor, httpMinor, method, status, headerIndex)
+    if (mesgComplete) then
+        -- bodiless request parsed in one go by the fast path
+        onMesgComplete(req, cbtype, remaining, keepAlive)
+    end
     return  cbtype, offset
 end
 
@@ -329,7 +470,8 @@ local function readAndParse(req)
 
     if (not hasContent(content, offset)) then
         -- read new content from socket
-        status, content = conn:read(req.readTimeout)
+        -- static routes are served by C only till the next request starts
+        status, content = conn:read(req.readTimeout, ((req.luaw_static_routes)and(not req.luaw_mesg_begun)))
         if (not status) then
             if (content == 'EOF') then
                 req:addHeader('Connection', 'close')
@@ -347,6 +489,8 @@ local function readAndParse(req)
     end
 
     httpcb, offset = parseHttpFragment(req, conn, parser, content, offset)
+    -- rest of this message, headers or body, must never be taken for a static route request
+    req.luaw_mesg_begun = true
 
     if (hasContent(content,offset)) then
         -- store back remaining content in request object for next HTTP request parsing
@@ -358,24 +502,10 @@ local function readAndParse(req)
     end
 end
 
-local function consumeTill(input, search, offset)
-    local start, stop = string.find(input, search, offset, true)
-    if (start and stop) then
-        return stop+1, string.sub(input, offset, start-1)
-    end
-end
-
 local function getMultipartBoundary(req)
     local header = req.headers['Content-Type']
-    if (header) then
-        local offset, contentType = consumeTill(header, ";", 1)
-        if (contentType == "multipart/form-data") then
-            local boundary
-            offset, boundary = consumeTill(header, "=", offset)
-            if ((boundary)and(string.find(boundary, "boundary", 1, true))) then
-                return '--'..string.sub(header, offset)
-            end
-        end
+    if ((header)and(string.find(string.lower(header), "multipart/form-data", 1, true))) then
+        return string.match(header, '[Bb]oundary="([^"]+)"') or string.match(header, '[Bb]oundary=([^%s;]+)')
     end
 end
 
@@ -387,7 +517,6 @@ local function isMultipart(req)
     local boundary = getMultipartBoundary(req)
     if (boundary) then
         req.luaw_multipart_boundary = boundary
-        req.luaw_multipart_end = boundary .. '--'
         return true
     end
 end
@@ -399,17 +528,46 @@ local function isLuaPackMesg(req)
     end
 end
 
-local function readFull(req)
+local CONTINUE_RESPONSE = "HTTP/1.1 100 Continue\r\n\r\n"
+
+-- true if HTTP/1.1 client waits for "100 Continue" before sending the request body
+local function expectsContinue(req)
+    local expect = req.headers['Expect']
+    if ((not expect)or(string.lower(expect) ~= '100-continue')) then
+        return false
+    end
+    local major, minor = req.major_version or 0, req.minor_version or 0
+    return ((major > 1)or((major == 1)and(minor >= 1)))
+end
+
+-- Optional checkExpectation(req) is called for requests with "Expect: 100-continue" header once their
+-- headers are parsed. If it returns false the body is never read and req.luaw_expectation_failed is
+-- set, caller must then send the final response and close the connection. Otherwise "100 Continue"
+-- is sent and the body read as usual.
+local function readFull(req, checkExpectation)
     -- first parse till headers are done
     while (not req.luaw_headers_done) do
         req:readAndParse()
     end
 
+    if ((req.luaw_mesg_type == 'sreq')and(not req.luaw_mesg_done)and(expectsContinue(req))) then
+        if ((checkExpectation)and(not checkExpectation(req))) then
+            req.luaw_expectation_failed = true
+            return
+        end
+        req.luaw_conn:write(CONTINUE_RESPONSE, req.writeTimeout)
+    end
+
     if ((isMultipart(req))or(isLuaPackMesg(req))) then
         -- multipart (file upload) HTTP requests and LuaPack requests are forced to be streaming to conserve memory
         return
     end
 
+    if ((BODY_SPOOL_THRESHOLD)and(req.luaw_mesg_type == 'sreq')and(not isFormPost(req))) then
+        -- big bodies are written to a temp file as they arrive, form params need body in memory
+        req.luaw_spool_body = true
+    end
+
     while (not req.luaw_mesg_done) do
         req:readAndParse()
     end
@@ -429,130 +587,107 @@ local function consumeBodyChunkParsed(req)
     return bodyChunk
 end
 
-local function bufferedConsume(req, search, content, offset)
-    assert(search, "search pattern cannot be nil")
+-- maps event codes returned by the C multipart parser, false means parser needs more content
+local multipartEvents = {false, PART_BEGIN, PART_DATA, PART_END, MULTIPART_END}
+
+-- Feeds body chunks to the multipart parser till it reports the next event. Part data is returned
+-- as str, i, j - the data being string.sub(str, i, j) - so that it can be written out without a copy
+local function nextMultipartEvent(req)
+    local parser = req.luaw_multipart_parser
+    if (not parser) then
+        local mesg
+        parser, mesg = luaw_http_lib.newMultipartParser(req.luaw_multipart_boundary)
+        assert(parser, mesg)
+        req.luaw_multipart_parser = parser
+    end
 
     while (true) do
-        if ((content)and(#content > offset)) then
-            local matchPos, matchStr  = consumeTill(content, search, offset)
-            if (matchPos) then
-                -- found match
-                if (matchPos < #content) then
-                    -- there is content remaining
-                    return matchStr, content, matchPos
-                end
-                -- content fully consumed
-                return matchStr, nil, nil
+        local content = req.luaw_multipart_content
+        if (content) then
+            local event, offset, v1, v2, v3 = parser:parse(content, req.luaw_multipart_offset)
+            assert(event, offset)
+            if (offset < #content) then
+                req.luaw_multipart_offset = offset
+            else
+                req.luaw_multipart_content = nil
             end
 
-            if (offset > 1) then
-                content = string.sub(content, offset)
-                offset = 1
+            event = multipartEvents[event]
+            if (event) then
+                return event, v1, v2, v3
             end
         end
 
-        -- match not found, read more
-        req:readAndParse()
-        if (req.luaw_mesg_done) then
+        content = req:consumeBodyChunkParsed()
+        if (content) then
+            req.luaw_multipart_content = content
+            req.luaw_multipart_offset = 0
+        elseif (req.luaw_mesg_done) then
             error("premature HTTP message end")
-        end
-
-        local readStr = req:consumeBodyChunkParsed()
-        if (readStr) then
-            if (content) then
-                content = content..readStr
-            else
-                content = readStr
-                offset = 1
-            end
+        else
+            req:readAndParse()
         end
     end
 end
 
-local function saveState(req, content, offset)
-    req.luaw_multipart_content = content
-    req.luaw_multipart_offset = offset
+-- discards epilogue following the last part so that the connection is ready for the next request
+local function drainMultipart(req)
+    req.luaw_multipart_content = nil
+    while (not req.luaw_mesg_done) do
+        req:readAndParse()
+        req:consumeBodyChunkParsed()
+    end
+    req:consumeBodyChunkParsed()
 end
 
-function fetchNextPart(req, state)
-    local content = req.luaw_multipart_content
-    local offset = req.luaw_multipart_offset or 1
-    local boundary = req.luaw_multipart_boundary
-    local matchStr
-
-    if (state == MULTIPART_BEGIN) then
-        -- read beginning boundary
-        matchedStr, content, offset = bufferedConsume(req, CRLF, content, offset)
-        assert(matchedStr == boundary, "Missing multi-part boundary at the beginning of the part")
-        state = PART_END
+local function fetchNextPart(req, state)
+    if (state == MULTIPART_END) then
+        return
     end
 
-    if (state == PART_END) then
-        -- read "Content-Disposition" line
-        matchedStr, content, offset = bufferedConsume(req, ": ", content, offset)
-        assert(matchedStr == 'Content-Disposition',"Missing 'Content-Disposition' header")
-
-        matchedStr, content, offset = bufferedConsume(req, "; ", content, offset)
-        assert(string.find(matchedStr, 'form-data', 1, true), "Wrong Content-Disposition")
-
-        matchedStr, content, offset = bufferedConsume(req, '"', content, offset)
-        assert(string.find(matchedStr, "name", 1, true), "form field name missing")
-
-        local fieldName
-        fieldName, content, offset = bufferedConsume(req, '"', content, offset)
-        assert(#fieldName > 0, "form field name missing")
-
-        matchedStr, content, offset = bufferedConsume(req, CRLF, content, offset)
-        local _, filenamePos = string.find(matchedStr, 'filename="', 1, true)
-        local fileName
-        if (filenamePos) then
-            fileName = string.sub(matchedStr, filenamePos+1, #matchedStr-1)
-        end
-
-        local contentType
-        if (fileName) then
-            -- read "Content-Type" line
-            matchedStr, content, offset = bufferedConsume(req, ": ", content, offset)
-            assert(matchedStr == 'Content-Type', "Missing 'Content-Type' header")
-
-            contentType, content, offset = bufferedConsume(req, CRLF, content, offset)
-            assert(#contentType, "Content-Type value missing")
-        end
-
-        -- read next blank line
-        matchedStr, content, offset = bufferedConsume(req, CRLF, content, offset)
-        assert(#matchedStr == 0, "Missing line separating content headers and actual content")
-
-        saveState(req, content, offset)
-        return PART_BEGIN, fieldName, fileName, contentType
+    -- token that ended the part saved by savePart()
+    local pending = req.luaw_multipart_pending
+    if (pending) then
+        req.luaw_multipart_pending = nil
+        return pending
     end
 
-    while ((state == PART_BEGIN)or(state == PART_DATA)) do
-        local matchedStr, content, offset = bufferedConsume(req, CRLF, content, offset)
-        if (matchedStr) then
-            if (matchedStr == boundary) then
-                saveState(req, content, offset)
-                return PART_END
-            end
-
-            local lastBoundary = req.luaw_multipart_end
-            if (matchedStr == lastBoundary) then
-                saveState(req, content, offset)
-                return MULTIPART_END
-            end
+    local event, v1, v2, v3 = nextMultipartEvent(req)
+    if (event == PART_DATA) then
+        return PART_DATA, string.sub(v1, v2, v3)
+    end
+    if (event == MULTIPART_END) then
+        drainMultipart(req)
+    end
+    return event, v1, v2, v3
+end
 
-            saveState(req, content, offset)
-            return PART_DATA, matchedStr
-        else
-            local content = req.luaw_multipart_content
-            local offset = req.luaw_consumed_till or 0
+-- Streams data of the current part - the one whose PART_BEGIN was just returned by the iterator - to
+-- file, which is either a file object or a path. Returns number of bytes written.
+local function savePart(req, file)
+    local path
+    if (type(file) == 'string') then
+        path = file
+        file = luaw_fs_lib.openFile(path, "w")
+    end
 
-            if ((content)and(#content-offset) > #boundary+3) then
-                saveState(req, nil, 1)
-                return PART_DATA, content
+    local startSize = file.size
+    while (true) do
+        local event, str, i, j = nextMultipartEvent(req)
+        if (event ~= PART_DATA) then
+            if (event == MULTIPART_END) then
+                drainMultipart(req)
             end
+            req.luaw_multipart_pending = event
+            break
         end
+        file:write(str, i, j)
+    end
+
+    if (path) then
+        file:close()
     end
+    return file.size - startSize
 end
 
 local function multiPartIterator(req)
@@ -562,7 +697,7 @@ local function multiPartIterator(req)
 end
 
 local function shouldCloseConnection(req)
-    if req and req.EOF then
+    if ((req)and((req.EOF)or(req.luaw_close_conn))) then
         return true
     end
 end
@@ -645,13 +780,11 @@ local function firstRequestLine(req)
     return table.concat(line)
 end
 
-local function sendBuffer(buffer, conn, writeTimeout, isChunked)
-	local chunk = table.concat(buffer)
+-- buffer is written in place and chunk framing is added by the connection while writing, so the
+-- content is never copied into a Lua string
+local function sendBuffer(buffer, conn, writeTimeout, isChunked, isLastChunk)
+    conn:write(buffer, writeTimeout, isChunked, isLastChunk)
 	buffer:reset()
-    if (isChunked) then
-        chunk = string.format("%x\r\n", #chunk)..chunk..CRLF
-    end
-    conn:write(chunk, writeTimeout)
 end
 
 local function bufferHeader(buffer, name, value)
@@ -677,21 +810,148 @@ local function bufferHeaders(headers, buffer)
     buffer:append(CRLF)
 end
 
-local function startStreaming(resp)
-    resp.luaw_is_chunked = true
-    resp:addHeader('Transfer-Encoding', 'chunked')
+local serializeResponse = luaw_http_lib.serializeResponse
+
+-- Writes status line/request line and headers followed by body buffer, if any. Server response heads are
+-- serialized in C straight into the connection's output buffer and go out in the same write as the
+-- body.
+local function sendHead(mesg, body)
+    local conn = mesg.luaw_conn
+    local writeTimeout = mesg.writeTimeout
+
+    if (mesg.luaw_mesg_type == 'sresp') then
+        local head = serializeResponse(mesg, conn)
+        mesg.headers = newHeaders()
+        if (not head) then
+            if (body) then
+                sendBuffer(body, conn, writeTimeout, false)
+            else
+                conn:write("", writeTimeout)
+            end
+            return
+        end
+        -- head did not fit in connection's buffer or conn is a pipelined response slot
+        conn:write(head, writeTimeout)
+    else
+        -- use separate buffer from "bodyParts" to serialize headers
+        local headersBuffer = newBuffer()
+        headersBuffer:append(mesg:firstLine())
+        bufferHeaders(mesg.headers, headersBuffer)
+        sendBuffer(headersBuffer, conn, writeTimeout, false)
+    end
+
+    if (body) then
+        sendBuffer(body, conn, writeTimeout, false)
+    end
+end
 
+--[[ Response compression. Server responses are compressed with zlib when compression is turned on,
+the client accepts gzip or deflate encoding and the response's content type is one of the
+compression_types. Full responses are compressed in one go if they are at least compression_min_size
+long. Streamed responses are compressed chunk by chunk as they are sent.
+]]
+local newDeflater = luaw_compress_lib.newDeflater
+
+local compressibleTypes = {}
+for _, contentType in ipairs(COMPRESSION_TYPES) do
+    compressibleTypes[contentType] = true
+end
+
+-- clients send the same Accept-Encoding over and over, remember the last one parsed
+local lastAcceptEncoding, lastQValues, lastEncoding
+
+local function parseAcceptEncoding(acceptEncoding)
+    if (acceptEncoding ~= lastAcceptEncoding) then
+        local qvalues = {}
+        for coding, params in string.gmatch(acceptEncoding, "%s*([^,;%s]+)([^,]*)") do
+            qvalues[string.lower(coding)] = tonumber(string.match(params, "[qQ]%s*=%s*([%d%.]+)")) or 1
+        end
+
+        local encoding, bestQ = nil, 0
+        for _, coding in ipairs({"gzip", "deflate"}) do
+            local q = qvalues[coding] or qvalues['*'] or 0
+            if (q > bestQ) then
+                encoding, bestQ = coding, q
+            end
+        end
+
+        lastAcceptEncoding, lastQValues, lastEncoding = acceptEncoding, qvalues, encoding
+    end
+    return lastQValues, lastEncoding
+end
+
+-- returns "gzip" or "deflate" as per Accept-Encoding header quality values, nil if neither is accepted
+local function negotiateEncoding(acceptEncoding)
+    if (not acceptEncoding) then
+        return nil
+    end
+    local _, encoding = parseAcceptEncoding(acceptEncoding)
+    return encoding
+end
+
+local function acceptsGzip(acceptEncoding)
+    if (not acceptEncoding) then
+        return false
+    end
+    local qvalues = parseAcceptEncoding(acceptEncoding)
+    return ((qvalues['gzip'] or qvalues['*'] or 0) > 0)
+end
+
+-- returns encoding to compress response body with, len is nil for streamed responses
+local function compressionEncoding(resp, len)
+    if ((not COMPRESSION)or(resp.luaw_mesg_type ~= 'sresp')) then
+        return nil
+    end
+
+    local status = resp.status or 200
     local headers = resp.headers
-    local conn = resp.luaw_conn
-    local writeTimeout = resp.writeTimeout
+    if ((status < 200)or(status == 204)or(status == 304)or(headers['Content-Encoding'])) then
+        return nil
+    end
+
+    local contentType = headers['Content-Type']
+    contentType = contentType and string.match(contentType, "^%s*([^;%s]+)")
+    if ((not contentType)or(not compressibleTypes[string.lower(contentType)])) then
+        return nil
+    end
+
+    -- response varies by Accept-Encoding even when this particular one is not compressed
+    resp:addHeader('Vary', 'Accept-Encoding')
+    if ((len)and(len < COMPRESSION_MIN_SIZE)) then
+        return nil
+    end
+    return negotiateEncoding(resp.luaw_accept_encoding)
+end
+
+-- optional flushThreshold overrides streaming_flush_threshold for this response
+local function startStreaming(resp, flushThreshold)
+    resp.luaw_is_chunked = true
+    resp.luaw_flush_threshold = flushThreshold
+    resp:addHeader('Transfer-Encoding', 'chunked')
 
-    -- use separate buffer from "bodyParts" to serialize headers
-    local headersBuffer = newBuffer()
-    headersBuffer:append(resp:firstLine())
-    bufferHeaders(headers, headersBuffer)
+    local encoding = compressionEncoding(resp)
+    if (encoding) then
+        resp:addHeader('Content-Encoding', encoding)
+        resp.luaw_deflater = newDeflater(encoding, COMPRESSION_LEVEL)
+        resp.luaw_compressed = newBuffer()
+    end
 
     -- flush up to HTTP headers end without chunked encoding before actual body starts
-    sendBuffer(headersBuffer, conn, writeTimeout, false)
+    sendHead(resp)
+end
+
+-- sends body buffered so far as a HTTP chunk, compressing it first if the response is compressed
+local function sendChunk(resp, isLastChunk)
+    local bodyBuffer = resp.bodyParts
+    local deflater = resp.luaw_deflater
+    if (deflater) then
+        local compressed = resp.luaw_compressed
+        -- sync flush so that the client can decompress everything sent so far
+        deflater:compress(bodyBuffer, compressed, (isLastChunk and "finish" or "sync"))
+        bodyBuffer:reset()
+        bodyBuffer = compressed
+    end
+    sendBuffer(bodyBuffer, resp.luaw_conn, resp.writeTimeout, true, isLastChunk)
 end
 
 local function appendBody(resp, bodyPart)
@@ -702,16 +962,77 @@ local function appendBody(resp, bodyPart)
     local bodyBuffer = resp.bodyParts
     local len = bodyBuffer:append(bodyPart)
 
-    if ((resp.luaw_is_chunked)and(len >= CONN_BUFFER_SIZE)) then
-        local conn = resp.luaw_conn
-        local writeTimeout = resp.writeTimeout
-        sendBuffer(bodyBuffer, conn, writeTimeout, true)
+    if ((resp.luaw_is_chunked)and(len >= (resp.luaw_flush_threshold or STREAMING_FLUSH_THRESHOLD))) then
+        sendChunk(resp, false)
     end
 end
 
+--[[ ETags. When turned on server responses with status 200 get an ETag computed by hashing their body
+with xxHash and files sent by path get one computed from the file content and modification time. The
+response is turned into "304 Not Modified" without any body if the ETag matches the request's
+If-None-Match header. An ETag set by the handler itself is left as is but still checked.
+]]
+local hash = luaw_buffer_lib.hash
+
+-- If-None-Match comparison is weak, W/ prefixes are ignored
+local function etagMatches(ifNoneMatch, etag)
+    if (not ifNoneMatch) then
+        return false
+    end
+    etag = (string.gsub(etag, "^W/", ""))
+    for tag in string.gmatch(ifNoneMatch, "[^,%s]+") do
+        if ((tag == '*')or((string.gsub(tag, "^W/", "")) == etag)) then
+            return true
+        end
+    end
+    return false
+end
+
+local function useETag(resp)
+    return ((ETAGS)and(resp.luaw_mesg_type == 'sresp')and((resp.status or 200) == 200))
+end
+
+-- adds ETag header unless already present, returns true if the response should be sent as 304 instead
+local function checkETag(resp, etag)
+    local headers = resp.headers
+    if (headers['ETag']) then
+        etag = headers['ETag']
+    else
+        resp:addHeader('ETag', etag)
+    end
+
+    if (etagMatches(resp.luaw_if_none_match, etag)) then
+        setStatus(resp, 304)
+        return true
+    end
+    return false
+end
+
+-- file ETags are computed when a file is first sent and recomputed only after it has been modified
+local fileETags = {}
+
+local function fileETag(path)
+    local attrs = lfs.attributes(path)
+    if (not attrs) then
+        return nil
+    end
+
+    local cached = fileETags[path]
+    if ((cached)and(cached.modification == attrs.modification)and(cached.size == attrs.size)) then
+        return cached.etag
+    end
+
+    local file = luaw_fs_lib.openFile(path)
+    local status, content = pcall(file.readAll, file)
+    file:close()
+    assert(status, content)
+
+    local etag = '"'..hash(content, attrs.modification)..'"'
+    fileETags[path] = {modification = attrs.modification, size = attrs.size, etag = etag}
+    return etag
+end
+
 local function writeFullBody(resp)
-    local conn = resp.luaw_conn
-    local writeTimeout = resp.writeTimeout
     local bodyBuffer = resp.bodyParts
 
     if (resp.method == 'POST') then
@@ -722,32 +1043,99 @@ local function writeFullBody(resp)
         end
     end
 
-    resp:addHeader('Content-Length', bodyBuffer.len)
+    local encoding = compressionEncoding(resp, bodyBuffer.len)
 
-    -- first write up to HTTP headers end
-    local headersBuffer = newBuffer()
-    headersBuffer:append(resp:firstLine())
-    bufferHeaders(resp.headers, headersBuffer)
-    sendBuffer(headersBuffer, conn, writeTimeout, false)
+    if (useETag(resp)) then
+        -- compressed and uncompressed representations must not share an ETag
+        local etag = encoding and ('"'..hash(bodyBuffer)..'-'..encoding..'"') or ('"'..hash(bodyBuffer)..'"')
+        if (checkETag(resp, etag)) then
+            bodyBuffer:reset()
+            sendHead(resp)
+            return
+        end
+    end
+
+    if (encoding) then
+        local compressed = newBuffer()
+        newDeflater(encoding, COMPRESSION_LEVEL):compress(bodyBuffer, compressed, "finish")
+        bodyBuffer:reset()
+        bodyBuffer = compressed
+        resp:addHeader('Content-Encoding', encoding)
+    end
 
-    -- now write body
-    sendBuffer(bodyBuffer, conn, writeTimeout, false)
+    resp:addHeader('Content-Length', bodyBuffer.len)
+
+    sendHead(resp, bodyBuffer)
 end
 
 local function endStreaming(resp)
+    -- flush whatever is remaining in write buffer followed by the last chunk encoding trailer
+    sendChunk(resp, true)
+end
+
+--[[ Precompressed static files. Webapps register files that have a gzipped sibling ("app.js" and
+"app.js.gz") once at startup. sendFile() sends the gzipped sibling instead of the file itself to the
+clients that accept gzip encoding, so that they are served without compressing them on every request.
+]]
+local precompressed = {}
+
+local function addPrecompressed(path, gzPath)
+    precompressed[path] = gzPath or (path..".gz")
+end
+
+luaw_http_lib.addPrecompressed = addPrecompressed
+
+-- Sends file as the whole message body. file is either a file object, like spooled request body,
+-- or a path of the file to send
+local function sendFile(resp, file, contentType)
     local conn = resp.luaw_conn
     local writeTimeout = resp.writeTimeout
-    local bodyBuffer = resp.bodyParts
+    local opened = (type(file) == 'string')
+    if (opened) then
+        local gzPath = precompressed[file]
+        if (gzPath) then
+            resp:addHeader('Vary', 'Accept-Encoding')
+            if ((not resp.headers['Content-Encoding'])and(acceptsGzip(resp.luaw_accept_encoding))) then
+                resp:addHeader('Content-Encoding', 'gzip')
+                file = gzPath
+            end
+        end
+
+        if (useETag(resp)) then
+            local etag = fileETag(file)
+            if ((etag)and(checkETag(resp, etag))) then
+                sendHead(resp)
+                resp.luaw_body_sent = true
+                return
+            end
+        end
 
-    -- flush whatever is remaining in write buffer
-    sendBuffer(bodyBuffer, conn, writeTimeout, true)
+        file = luaw_fs_lib.openFile(file)
+    end
 
-    -- add last chunk encoding trailer
-    conn:write("0\r\n\r\n", writeTimeout)
+    if (contentType) then
+        resp:addHeader('Content-Type', contentType)
+    end
+    resp:addHeader('Content-Length', file.size)
+    sendHead(resp)
+
+    local status, err = pcall(function()
+        for chunk in file:chunks() do
+            conn:write(chunk, writeTimeout)
+        end
+    end)
+    if (opened) then
+        file:close()
+    end
+    assert(status, err)
+    resp.luaw_body_sent = true
 end
 
 local function flush(resp)
-    if resp.luaw_is_chunked then
+    if resp.luaw_body_sent then
+        -- body already sent by sendFile()
+        return
+    elseif resp.luaw_is_chunked then
         endStreaming(resp)
     else
         writeFullBody(resp)
@@ -762,8 +1150,19 @@ local function close(req)
     end
 end
 
+-- closes temp file of a spooled request body, if any
+local function releaseBody(req)
+    local bodyFile = req.luaw_body_file
+    if (bodyFile) then
+        req.luaw_body_file = nil
+        req.luaw_spool_body = nil
+        bodyFile:close()
+    end
+end
+
 local function reset(req)
-    req.headers = {}
+    releaseBody(req)
+    req.headers = newHeaders()
     req["_acc_header_name_"] = nil
     req["_acc_header_value_"] = nil
     req.url = nil
@@ -775,49 +1174,145 @@ local function reset(req)
     req.parsedURL = nil
     req.status = nil
     req.statusMesg = nil
+    req.luaw_multipart_boundary = nil
+    req.luaw_multipart_parser = nil
+    req.luaw_multipart_content = nil
+    req.luaw_multipart_pending = nil
+    req.cookies = nil
 end
 
-luaw_http_lib.newServerHttpRequest = function(conn)
-	local req = {
-	    luaw_mesg_type = 'sreq',
-	    luaw_conn = conn,
-	    headers = {},
-		bodyParts = newBuffer(),
-	    luaw_parser = luaw_http_lib:newHttpRequestParser(),
-	    addHeader = addHeader,
-	    shouldCloseConnection = shouldCloseConnection,
-	    isComplete = isComplete,
-	    readAndParse = readAndParse,
-	    readFull = readFull,
-	    isMultipart = isMultipart,
-	    multiPartIterator = multiPartIterator,
-	    getBody = getBody,
-	    reset = reset,
-	    consumeBodyChunkParsed = consumeBodyChunkParsed,
-	    close = close
-	}
-    return req;
+-- Cookies are parsed on first access to req.cookies. req:getCookie(name) looks up a single cookie
+-- straight from the Cookie header without building the cookies table, unless it is already built
+local parseCookies = luaw_http_lib.parseCookies
+local getCookieInternal = luaw_http_lib.getCookie
+
+local function getCookie(req, name)
+    local cookies = rawget(req, 'cookies')
+    if (cookies) then
+        return cookies[name]
+    end
+    return getCookieInternal(req.headers['Cookie'], name)
 end
 
-luaw_http_lib.newServerHttpResponse = function(conn)
-    local resp = {
-        luaw_mesg_type = 'sresp',
-        luaw_conn = conn,
-        major_version = 1,
-        minor_version = 1,
-        contentLength = 0,
-        headers = {},
-        bodyParts = newBuffer(),
+--[[ Request and response methods live in metatables shared by all the messages of a kind, so that
+creating a message doesn't mean filling a dozen function valued fields. On keep-alive connections
+serviceHTTP() goes further and recycles the previous request and response objects, along with their
+body buffers and parser, by clearing them instead of allocating new ones. Handlers must not hold on
+to req or resp once they have returned.
+]]
+local serverRequestMethods = {
+    addHeader = addHeader,
+    shouldCloseConnection = shouldCloseConnection,
+    isComplete = isComplete,
+    readAndParse = readAndParse,
+    readFull = readFull,
+    isMultipart = isMultipart,
+    multiPartIterator = multiPartIterator,
+    savePart = savePart,
+    getBody = getBody,
+    releaseBody = releaseBody,
+    reset = reset,
+    consumeBodyChunkParsed = consumeBodyChunkParsed,
+    getCookie = getCookie,
+    close = close
+}
+
+local serverRequestMT = {
+    __index = function(req, key)
+        local method = serverRequestMethods[key]
+        if (method) then
+            return method
+        end
+        if (key == 'cookies') then
+            local cookies = parseCookies(req.headers['Cookie'])
+            rawset(req, 'cookies', cookies)
+            return cookies
+        end
+    end
+}
+
+local serverResponseMT = {
+    __index = {
         addHeader = addHeader,
         shouldCloseConnection = shouldCloseConnection,
         setStatus = setStatus,
         firstLine = firstResponseLine,
         startStreaming = startStreaming,
         appendBody = appendBody,
+        sendFile = sendFile,
         flush = flush,
         reset = reset,
         close = close
     }
+}
+
+local clientResponseMT = {
+    __index = {
+        addHeader = addHeader,
+        shouldCloseConnection = shouldCloseConnection,
+        readAndParse = readAndParse,
+        getBody = getBody,
+        getStatus = getStatus,
+        readFull = readFull,
+        consumeBodyChunkParsed = consumeBodyChunkParsed,
+        reset = reset,
+        close = close
+    }
+}
+
+-- fields that outlive a message when its object is recycled for the next one on the same connection.
+-- Content read past the end of the previous request belongs to the next one.
+local recycledFields = {
+    luaw_mesg_type = true,
+    luaw_conn = true,
+    bodyParts = true,
+    luaw_parser = true,
+    luaw_read_content = true,
+    luaw_read_offset = true
+}
+
+local function recycle(mesg)
+    for key in pairs(mesg) do
+        if (not recycledFields[key]) then
+            mesg[key] = nil
+        end
+    end
+    mesg.bodyParts:reset()
+    mesg.headers = newHeaders()
+    return mesg
+end
+
+-- prevReq, if given, is the previous request on the same connection which is recycled
+luaw_http_lib.newServerHttpRequest = function(conn, prevReq)
+    if (prevReq) then
+        return recycle(prevReq)
+    end
+	local req = {
+	    luaw_mesg_type = 'sreq',
+	    luaw_conn = conn,
+	    headers = newHeaders(),
+		bodyParts = newBuffer(),
+	    luaw_parser = luaw_http_lib:newHttpRequestParser()
+	}
+    return setmetatable(req, serverRequestMT);
+end
+
+-- prevResp, if given, is the previous response on the same connection which is recycled
+luaw_http_lib.newServerHttpResponse = function(conn, prevResp)
+    local resp
+    if (prevResp) then
+        resp = recycle(prevResp)
+    else
+        resp = setmetatable({
+            luaw_mesg_type = 'sresp',
+            luaw_conn = conn,
+            headers = newHeaders(),
+            bodyParts = newBuffer()
+        }, serverResponseMT)
+    end
+    resp.major_version = 1
+    resp.minor_version = 1
+    resp.contentLength = 0
     return resp;
 end
 
@@ -825,20 +1320,11 @@ local function newClientHttpResponse(conn)
 	local resp = {
 	    luaw_mesg_type = 'cresp',
 	    luaw_conn = conn,
-	    headers = {},
+	    headers = newHeaders(),
 		bodyParts = newBuffer(),
-	    luaw_parser = luaw_http_lib:newHttpResponseParser(),
-	    addHeader = addHeader,
-	    shouldCloseConnection = shouldCloseConnection,
-	    readAndParse = readAndParse,
-	    getBody = getBody,
-	    getStatus = getStatus,
-	    readFull = readFull,
-	    consumeBodyChunkParsed = consumeBodyChunkParsed,
-	    reset = reset,
-	    close = close
+	    luaw_parser = luaw_http_lib:newHttpResponseParser()
 	}
-	return resp;
+	return setmetatable(resp, clientResponseMT);
 end
 
 local function connect(req)
@@ -856,7 +1342,139 @@ local function connectReq(req)
     return resp
 end
 
-local function execute(req)
+-- Wakes up given thread after delay milliseconds unless cancelWakeUp() is called first
+local function wakeUpAfter(threadCtx, delay)
+    local waker = { elapsed = false, timer = luaw_timer_lib.newTimer() }
+    assert(waker.timer:start(delay))
+
+    scheduler.startUserThread(function()
+        local timer = waker.timer
+        local status, elapsed = timer:wait()
+        timer:delete()
+        if ((status)and(elapsed)) then
+            waker.elapsed = true
+            scheduler.wakeUp(threadCtx)
+        end
+    end)
+
+    return waker
+end
+
+local function cancelWakeUp(waker)
+    if (not waker.elapsed) then
+        waker.timer:stop()
+    end
+end
+
+--[[ Per upstream concurrency limits: at most maxInFlight requests are allowed to be in flight
+to the same upstream host:port at any given time. Threads trying to execute a request over this
+limit wait in a FIFO queue and are handed the slot of a finishing request directly. If the
+upstream has queueTimeout configured, a thread that could not get a slot in time fails fast with
+an error instead of waiting any longer.
+]]
+
+local upstreams = {}
+
+local function upstreamKey(hostName, hostIP, port)
+    return tostring(hostName or hostIP)..':'..tostring(port)
+end
+
+local function getUpstream(req)
+    local key = upstreamKey(req.hostName, req.hostIP, req.port)
+    local upstream = upstreams[key]
+    if (not upstream) then
+        local limits = UPSTREAM_LIMITS[key] or {}
+        upstream = {
+            key = key,
+            inFlight = 0,
+            maxInFlight = limits.max_in_flight or DEFAULT_UPSTREAM_MAX_IN_FLIGHT,
+            queueTimeout = limits.queue_timeout or DEFAULT_UPSTREAM_QUEUE_TIMEOUT
+        }
+        upstreams[key] = upstream
+    end
+    return upstream
+end
+
+luaw_http_lib.setUpstreamLimit = function(host, port, maxInFlight, queueTimeout)
+    local upstream = getUpstream({hostName = host, port = port or 80})
+    upstream.maxInFlight = maxInFlight
+    upstream.queueTimeout = queueTimeout
+end
+
+local function enqueueWaiter(upstream, waiter)
+    local tail = upstream.waitTail
+    if (tail) then
+        tail.next = waiter
+    else
+        upstream.waitHead = waiter
+    end
+    upstream.waitTail = waiter
+end
+
+local function dequeueWaiter(upstream)
+    local waiter = upstream.waitHead
+    while (waiter) do
+        upstream.waitHead = waiter.next
+        if (not upstream.waitHead) then
+            upstream.waitTail = nil
+        end
+        waiter.next = nil
+        if (not waiter.timedOut) then
+            return waiter
+        end
+        -- skip waiters that have already given up
+        waiter = upstream.waitHead
+    end
+end
+
+local function acquireUpstream(req)
+    local upstream = getUpstream(req)
+    local maxInFlight = upstream.maxInFlight
+
+    if ((not maxInFlight)or((upstream.inFlight < maxInFlight)and(not upstream.waitHead))) then
+        upstream.inFlight = upstream.inFlight + 1
+        return upstream
+    end
+
+    local waiter = {
+        threadCtx = assert(scheduler.threadCtx(), "HTTP request must be executed from a Luaw thread")
+    }
+    enqueueWaiter(upstream, waiter)
+
+    local waker
+    local queueTimeout = upstream.queueTimeout
+    if ((queueTimeout)and(queueTimeout > 0)) then
+        waker = wakeUpAfter(waiter.threadCtx, queueTimeout)
+    end
+
+    while ((not waiter.granted)and(not ((waker)and(waker.elapsed)))) do
+        scheduler.suspend()
+    end
+
+    if (waker) then
+        cancelWakeUp(waker)
+    end
+
+    if (not waiter.granted) then
+        waiter.timedOut = true
+        error("Timed out waiting for a free slot to upstream "..upstream.key, 0)
+    end
+
+    -- releasing thread has transferred its slot to us, inFlight count stays the same
+    return upstream
+end
+
+local function releaseUpstream(upstream)
+    local waiter = dequeueWaiter(upstream)
+    if (waiter) then
+        waiter.granted = true
+        scheduler.wakeUp(waiter.threadCtx)
+    else
+        upstream.inFlight = upstream.inFlight - 1
+    end
+end
+
+local function executeInternal(req)
     local resp = req:connect()
     req:flush()
     resp:readFull()
@@ -866,6 +1484,336 @@ local function execute(req)
     return resp
 end
 
+--[[ HTTP/1.1 pipelining: requests marked with req.pipeline = true are written back to back on a
+persistent connection shared with other pipelined requests to the same upstream, without waiting
+for the responses of the requests written before them. Each such connection keeps a queue of
+pending responses in the order in which requests were written. Only the thread at the head of
+this queue reads from the connection, using its own response parser. Once its response is parsed
+it hands over the bytes left over in the read buffer to the next thread in the queue and wakes it.
+]]
+
+local function newPipeline(upstream, req)
+    local conn = connect(req)
+    conn:startReading()
+    local pipe = { conn = conn, depth = 0, writeWaiters = {} }
+    table.insert(upstream.pipelines, pipe)
+    return pipe
+end
+
+local function closePipeline(upstream, pipe)
+    if (pipe.broken) then
+        return
+    end
+    pipe.broken = true
+
+    local pipelines = upstream.pipelines
+    for i, p in ipairs(pipelines) do
+        if (p == pipe) then
+            table.remove(pipelines, i)
+            break
+        end
+    end
+    pipe.conn:close()
+
+    -- responses to requests still in the queue are never going to arrive, let their threads fail
+    local entry = pipe.head
+    while (entry) do
+        scheduler.wakeUp(entry.threadCtx)
+        entry = entry.next
+    end
+    for i, waiter in ipairs(pipe.writeWaiters) do
+        scheduler.wakeUp(waiter.threadCtx)
+    end
+end
+
+local function getPipeline(upstream, req)
+    local pipelines = upstream.pipelines
+    if (not pipelines) then
+        pipelines = {}
+        upstream.pipelines = pipelines
+    end
+
+    local best
+    for i = #pipelines, 1, -1 do
+        local pipe = pipelines[i]
+        if (not pipe.conn:isOpen()) then
+            -- closed by the upstream while idle
+            closePipeline(upstream, pipe)
+        elseif ((pipe.depth < PIPELINE_DEPTH)and((not best)or(pipe.depth < best.depth))) then
+            best = pipe
+        end
+    end
+
+    return best or newPipeline(upstream, req)
+end
+
+local function lockPipelineWrites(pipe, threadCtx)
+    if (not pipe.writing) then
+        pipe.writing = true
+        return
+    end
+
+    local waiter = { threadCtx = threadCtx }
+    table.insert(pipe.writeWaiters, waiter)
+    while ((not waiter.granted)and(not pipe.broken)) do
+        scheduler.suspend()
+    end
+    if (not waiter.granted) then
+        error("Pipelined connection to upstream closed", 0)
+    end
+end
+
+local function unlockPipelineWrites(pipe)
+    local waiter = table.remove(pipe.writeWaiters, 1)
+    if (waiter) then
+        waiter.granted = true
+        scheduler.wakeUp(waiter.threadCtx)
+    else
+        pipe.writing = false
+    end
+end
+
+local function writePipelined(pipe, req, entry)
+    lockPipelineWrites(pipe, entry.threadCtx)
+
+    -- responses arrive in the same order in which requests are written
+    local tail = pipe.tail
+    if (tail) then
+        tail.next = entry
+    else
+        pipe.head = entry
+    end
+    pipe.tail = entry
+
+    req.luaw_conn = pipe.conn
+    local status, err = pcall(req.flush, req)
+    unlockPipelineWrites(pipe)
+    if (not status) then
+        error(err, 0)
+    end
+end
+
+local function readPipelined(pipe, req, entry)
+    while ((pipe.head ~= entry)and(not pipe.broken)) do
+        scheduler.suspend()
+    end
+    if (pipe.broken) then
+        error("Pipelined connection to upstream closed", 0)
+    end
+
+    local resp = newClientHttpResponse(pipe.conn)
+    resp.readTimeout = req.readTimeout
+    resp.writeTimeout = req.writeTimeout
+    resp.luaw_read_content = pipe.content
+    resp.luaw_read_offset = pipe.offset
+
+    -- response must be read in full, even if it is a streaming one, to get to the next response
+    while (not resp.luaw_mesg_done) do
+        resp:readAndParse()
+    end
+
+    pipe.content = resp.luaw_read_content
+    pipe.offset = resp.luaw_read_offset
+    return resp
+end
+
+local function executePipelined(req, upstream)
+    local pipe = getPipeline(upstream, req)
+    local entry = { threadCtx = scheduler.threadCtx() }
+    pipe.depth = pipe.depth + 1
+
+    local status, resp = pcall(writePipelined, pipe, req, entry)
+    if (status) then
+        status, resp = pcall(readPipelined, pipe, req, entry)
+    end
+    pipe.depth = pipe.depth - 1
+
+    if ((not status)or(resp:shouldCloseConnection())) then
+        closePipeline(upstream, pipe)
+    else
+        -- hand over the connection to the next response in the queue
+        local nextEntry = entry.next
+        pipe.head = nextEntry
+        if (not nextEntry) then
+            pipe.tail = nil
+        else
+            scheduler.wakeUp(nextEntry.threadCtx)
+        end
+    end
+
+    -- connection is owned by the pipeline, detach it so that req/resp:close() leave it alone
+    req.luaw_conn = nil
+    if (not status) then
+        error(resp, 0)
+    end
+    resp.luaw_conn = nil
+    return resp
+end
+
+local function execute(req)
+    local upstream = acquireUpstream(req)
+    local status, resp
+    if (req.pipeline) then
+        status, resp = pcall(executePipelined, req, upstream)
+    else
+        status, resp = pcall(executeInternal, req)
+    end
+    releaseUpstream(upstream)
+    if (not status) then
+        error(resp, 0)
+    end
+    return resp
+end
+
+--[[ Hedged requests: if the primary upstream has not answered within hedge.delay milliseconds
+a duplicate request is sent to the hedge upstream. Whichever response arrives first wins and the
+connection of the losing request is closed, which unblocks the thread executing it.
+]]
+
+local function copyHeaders(headers)
+    local copy = {}
+    if (headers) then
+        for name, value in pairs(headers) do
+            if (type(value) == 'table') then
+                local values = {}
+                for i, v in ipairs(value) do
+                    values[i] = v
+                end
+                copy[name] = values
+            else
+                copy[name] = value
+            end
+        end
+    end
+    return copy
+end
+
+-- Duplicate of a client request to be sent to the hedge upstream. Must be created before the
+-- original request is flushed as flushing consumes request's headers and body.
+local function newHedgeRequest(req, hedge)
+    assert((hedge.hostName or hedge.hostIP), "Either hostName or hostIP must be specified for hedge upstream")
+
+    local hedgeReq = luaw_http_lib.newClientHttpRequest()
+    hedgeReq.hostName = hedge.hostName
+    hedgeReq.hostIP = hedge.hostIP
+    hedgeReq.port = hedge.port or req.port
+    hedgeReq.method = req.method
+    hedgeReq.url = req.url
+    hedgeReq.params = req.params
+    hedgeReq.major_version = req.major_version
+    hedgeReq.minor_version = req.minor_version
+    hedgeReq.connectTimeout = req.connectTimeout
+    hedgeReq.readTimeout = req.readTimeout
+    hedgeReq.writeTimeout = req.writeTimeout
+    hedgeReq.headers = copyHeaders(req.headers)
+
+    hedgeReq.bodyParts:append(req.bodyParts)
+    return hedgeReq
+end
+
+local function executeHedgeAttempt(race, req)
+    local resp = connectReq(req)
+    if (race.winner) then
+        -- race was decided while we were still connecting
+        resp:close()
+        return nil
+    end
+    req:flush()
+    resp:readFull()
+    return resp
+end
+
+local function executeHedgeAttemptWithinLimit(race, req)
+    local upstream = acquireUpstream(req)
+    if (race.winner) then
+        -- race was decided while we were waiting for a free slot
+        releaseUpstream(upstream)
+        return nil
+    end
+    local status, resp = pcall(executeHedgeAttempt, race, req)
+    releaseUpstream(upstream)
+    if (not status) then
+        error(resp, 0)
+    end
+    return resp
+end
+
+local function runHedgeAttempt(race, req)
+    local status, resp = pcall(executeHedgeAttemptWithinLimit, race, req)
+    race.pending = race.pending - 1
+
+    if (status) then
+        if ((race.winner)or(not resp)or(not resp.status)) then
+            -- lost the race or got cancelled before response arrived
+            if (resp) then resp:close() end
+        else
+            race.winner = req
+            race.resp = resp
+        end
+    else
+        race.err = resp
+    end
+
+    scheduler.wakeUp(race.waiter)
+end
+
+local function startHedgeAttempt(race, req)
+    table.insert(race.attempts, req)
+    race.pending = race.pending + 1
+    scheduler.startUserThread(runHedgeAttempt, race, req)
+end
+
+local function executeHedged(req)
+    local hedge = req.hedge
+    local delay = assert(hedge.delay, "Missing hedge delay")
+
+    local race = {
+        waiter = assert(scheduler.threadCtx(), "Hedged request must be executed from a Luaw thread"),
+        attempts = {},
+        pending = 0
+    }
+    local hedgeReq = newHedgeRequest(req, hedge)
+
+    startHedgeAttempt(race, req)
+    local waker = wakeUpAfter(race.waiter, delay)
+    while ((not race.winner)and(race.pending > 0)and(not waker.elapsed)) do
+        scheduler.suspend()
+    end
+    cancelWakeUp(waker)
+
+    if (not race.winner) then
+        -- primary upstream is either slow or has failed, send duplicate to the hedge upstream
+        startHedgeAttempt(race, hedgeReq)
+        while ((not race.winner)and(race.pending > 0)) do
+            scheduler.suspend()
+        end
+    end
+
+    -- cancel losing request, if it is still in flight
+    for i, attempt in ipairs(race.attempts) do
+        if (attempt ~= race.winner) then
+            attempt:close()
+        end
+    end
+
+    if (not race.winner) then
+        error(race.err or "Hedged request failed")
+    end
+
+    local resp = race.resp
+    if resp:shouldCloseConnection() then
+        resp:close()
+    end
+    return resp
+end
+
+local function executeReq(req)
+    if (req.hedge) then
+        return executeHedged(req)
+    end
+    return execute(req)
+end
+
 
 luaw_http_lib.newClientHttpRequest = function()
     local req = {
@@ -875,16 +1823,17 @@ luaw_http_lib.newClientHttpRequest = function()
         minor_version = 1,
         method = 'GET',
         contentLength = 0,
-        headers = {},
+        headers = newHeaders(),
 		bodyParts = newBuffer(),
         addHeader = addHeader,
         connect = connectReq,
-        execute = execute,
+        execute = executeReq,
         shouldCloseConnection = shouldCloseConnection,
         buildURL = buildURL,
         firstLine = firstRequestLine,
         startStreaming = startStreaming,
         appendBody = appendBody,
+        sendFile = sendFile,
         flush = flush,
         reset = reset,
         close = close
@@ -893,4 +1842,120 @@ luaw_http_lib.newClientHttpRequest = function()
 end
 
 
+--[[
+Ordered response queue for server side pipelining. Every pipelined request gets a slot in the queue
+that stands in for the connection in its response object. Only the slot at the head of the queue
+writes to the connection directly, slots behind it buffer their writes till all the responses before
+them have been sent. Connection is closed only after all the queued responses are sent.
+]]
+
+local slotMT = {}
+slotMT.__index = slotMT
+
+function slotMT:write(str, writeTimeout, chunked, lastChunk)
+    self.writeTimeout = writeTimeout
+    if (self.direct) then
+        return self.queue.conn:write(str, writeTimeout, chunked, lastChunk)
+    end
+    -- buffers are reused by their owner once write returns
+    str = tostring(str)
+    if (chunked) then
+        if (#str > 0) then
+            str = string.format("%x\r\n", #str)..str..CRLF
+        end
+        if (lastChunk) then
+            str = str.."0\r\n\r\n"
+        end
+    end
+    table.insert(self.buffered, str)
+    return #str
+end
+
+function slotMT:close()
+    -- close the connection once responses queued so far are sent
+    self.queue.closing = true
+end
+
+function slotMT:isOpen()
+    return ((not self.queue.closing)and(self.queue.conn:isOpen()))
+end
+
+local queueMT = {}
+queueMT.__index = queueMT
+
+function queueMT:add()
+    local slot = setmetatable({queue = self, buffered = {}}, slotMT)
+    if (self.tail) then
+        self.tail.next = slot
+    else
+        self.head = slot
+        slot.direct = true
+    end
+    self.tail = slot
+    self.inFlight = self.inFlight + 1
+    return slot
+end
+
+local function flushSlot(queue, slot)
+    local buffered = slot.buffered
+    while (#buffered > 0) do
+        slot.buffered = {}
+        queue.conn:write(table.concat(buffered), slot.writeTimeout)
+        buffered = slot.buffered
+    end
+end
+
+-- Sends responses of completed slots at the head of the queue in order, and switches the first slot
+-- still in progress to direct writes. Runs on one thread at a time so that the writes don't interleave
+local function flushCompleted(queue)
+    while true do
+        local head = queue.head
+        if (not head) then return end
+        flushSlot(queue, head)
+        if (not head.done) then
+            head.direct = true
+            return
+        end
+        queue.inFlight = queue.inFlight - 1
+        queue.head = head.next
+        if (not queue.head) then
+            queue.tail = nil
+        end
+    end
+end
+
+function queueMT:complete(slot)
+    slot.done = true
+    if (not self.flushing) then
+        self.flushing = true
+        local status = pcall(flushCompleted, self)
+        self.flushing = false
+        if (not status) then
+            -- write failed, responses still queued can't be sent any more
+            self.closing = true
+            self.inFlight = 0
+            self.head, self.tail = nil, nil
+        end
+    end
+
+    if ((self.closing)and(self.inFlight == 0)) then
+        -- unblocks reader thread if it is waiting for the next request
+        self.conn:close()
+    end
+    scheduler.wakeUp(self.readerCtx)
+end
+
+-- blocks the calling (reader) thread till condition returns true. Slot completions wake it up
+function queueMT:waitUntil(condition)
+    while (not condition(self)) do
+        self.readerCtx = scheduler.threadCtx()
+        scheduler.suspend()
+    end
+    self.readerCtx = nil
+end
+
+luaw_http_lib.newResponseQueue = function(conn)
+    return setmetatable({conn = conn, inFlight = 0}, queueMT)
+end
+
 return luaw_http_lib
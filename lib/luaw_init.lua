@@ -26,7 +26,9 @@ luaw_lpack = require("luapack")
 luaw_scheduler = require("luaw_scheduler")
 luaw_tcp = require("luaw_tcp")
 luaw_timer = require("luaw_timer")
+luaw_fs = require("luaw_fs")
 luaw_http = require("luaw_http")
+luaw_redis = require("luaw_redis")
 luaw_webapp = require("luaw_webapp")
 
 luaw_webapp.init()
\ No newline at end of file
@@ -0,0 +1,327 @@
+--[[
+Copyright (c) 2015 raksoras
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+]]
+
+local constants = require('luaw_constants')
+local scheduler = require('luaw_scheduler')
+local luaw_tcp = require('luaw_tcp')
+
+local DEFAULT_REDIS_PORT = 6379
+local REDIS_POOL_SIZE = constants.REDIS_POOL_SIZE
+
+local parseReply = luaw_redis_lib.parseReply
+local encodeCommand = luaw_redis_lib.encodeCommand
+
+--[[ Redis client with automatic pipelining. Commands issued by all threads within the same
+scheduler tick are queued up on a connection and written to it together in a single write by a
+background flusher thread. Replies arrive in the same order. Whichever waiting thread finds nobody
+reading from the connection reads and parses replies on behalf of everybody and wakes up their
+threads. When done it hands the reading over to the next thread still waiting for its reply.
+]]
+
+local function failConnection(rc, err)
+    if (rc.broken) then
+        return
+    end
+    rc.broken = err or "Redis connection closed"
+
+    local pool = rc.client.pool
+    for i, r in ipairs(pool) do
+        if (r == rc) then
+            table.remove(pool, i)
+            break
+        end
+    end
+    if (rc.conn) then
+        rc.conn:close()
+    end
+
+    local entry = rc.head
+    while (entry) do
+        scheduler.wakeUp(entry.threadCtx)
+        entry = entry.next
+    end
+    rc.head = nil
+    rc.tail = nil
+
+    for i, threadCtx in ipairs(rc.readyWaiters) do
+        scheduler.wakeUp(threadCtx)
+    end
+end
+
+local function flush(rc)
+    local conn = rc.conn
+    while ((#rc.outBuf > 0)and(not rc.broken)) do
+        local out = table.concat(rc.outBuf)
+        rc.outBuf = {}
+        local status, err = pcall(conn.write, conn, out, rc.client.writeTimeout)
+        if (not status) then
+            failConnection(rc, err)
+        end
+    end
+    rc.flushing = false
+end
+
+local function send(rc, ...)
+    local entry = { threadCtx = scheduler.threadCtx() }
+    table.insert(rc.outBuf, encodeCommand(...))
+
+    local tail = rc.tail
+    if (tail) then
+        tail.next = entry
+    else
+        rc.head = entry
+    end
+    rc.tail = entry
+    rc.pending = rc.pending + 1
+
+    if (not rc.flushing) then
+        -- flusher runs once current thread blocks, picking up all commands queued till then
+        rc.flushing = true
+        scheduler.startUserThread(flush, rc)
+    end
+    return entry
+end
+
+local function dispatchReply(rc, reply, kind)
+    if (kind == "push") then
+        -- RESP3 out of band push messages are not request replies
+        return
+    end
+
+    local entry = rc.head
+    if (not entry) then
+        error("Unexpected reply received from Redis", 0)
+    end
+    rc.head = entry.next
+    if (not rc.head) then
+        rc.tail = nil
+    end
+    rc.pending = rc.pending - 1
+
+    entry.done = true
+    if (kind == "error") then
+        entry.err = reply
+    else
+        entry.reply = reply
+    end
+    scheduler.wakeUp(entry.threadCtx)
+end
+
+-- Reads are collected in rc.inBuffer. Replies are parsed only once enough bytes have arrived for the
+-- reply at the head of the buffer to be complete, so a big reply arriving over many reads is not
+-- re-parsed from its start on every read
+local function readReplies(rc)
+    local status, str = rc.conn:read(rc.client.readTimeout)
+    if (not status) then
+        error(str or "Redis connection closed", 0)
+    end
+
+    local inBuffer = rc.inBuffer
+    if (inBuffer:append(str) < rc.need) then
+        return
+    end
+
+    local offset = 1
+    while (true) do
+        local reply, nextOffset, kind, need = parseReply(inBuffer, offset)
+        if (not nextOffset) then
+            rc.need = need - (offset - 1)
+            break
+        end
+        offset = nextOffset
+        dispatchReply(rc, reply, kind)
+    end
+    inBuffer:discard(offset - 1)
+end
+
+local function awaitReply(rc, entry)
+    while ((not entry.done)and(not rc.broken)) do
+        if (rc.reading) then
+            scheduler.suspend()
+        else
+            rc.reading = true
+            local status, err = pcall(readReplies, rc)
+            rc.reading = false
+            if (not status) then
+                failConnection(rc, err)
+            end
+        end
+    end
+
+    local head = rc.head
+    if ((head)and(not rc.reading)) then
+        -- let the next thread in line take over reading
+        scheduler.wakeUp(head.threadCtx)
+    end
+
+    if (not entry.done) then
+        error(rc.broken, 0)
+    end
+    return entry.reply, entry.err
+end
+
+local function call(rc, ...)
+    return awaitReply(rc, send(rc, ...))
+end
+
+local function handshake(rc)
+    local client = rc.client
+    local reply, err
+
+    if (client.protocol == 3) then
+        if (client.password) then
+            reply, err = call(rc, "HELLO", 3, "AUTH", client.username or "default", client.password)
+        else
+            reply, err = call(rc, "HELLO", 3)
+        end
+    elseif (client.password) then
+        if (client.username) then
+            reply, err = call(rc, "AUTH", client.username, client.password)
+        else
+            reply, err = call(rc, "AUTH", client.password)
+        end
+    end
+    assert(not err, err)
+
+    if (client.db) then
+        reply, err = call(rc, "SELECT", client.db)
+        assert(not err, err)
+    end
+end
+
+local function openConnection(client)
+    local rc = { client = client, outBuf = {}, inBuffer = luaw_buffer_lib.newBuffer(), need = 0, pending = 0, readyWaiters = {} }
+    table.insert(client.pool, rc)
+
+    local status, err = pcall(function()
+        rc.conn = luaw_tcp.connect(client.hostIP, client.hostName, client.port, client.connectTimeout)
+        rc.conn:startReading()
+        handshake(rc)
+    end)
+    if (not status) then
+        failConnection(rc, err)
+        error(err, 0)
+    end
+
+    rc.ready = true
+    for i, threadCtx in ipairs(rc.readyWaiters) do
+        scheduler.wakeUp(threadCtx)
+    end
+    rc.readyWaiters = {}
+    return rc
+end
+
+local function getConnection(client)
+    local pool = client.pool
+    local best
+
+    for i = #pool, 1, -1 do
+        local rc = pool[i]
+        if ((rc.ready)and(not rc.conn:isOpen())) then
+            -- closed by Redis while idle
+            failConnection(rc, "Redis connection closed")
+        elseif ((not best)or(rc.pending < best.pending)) then
+            best = rc
+        end
+    end
+
+    if ((not best)or((best.pending > 0)and(#pool < client.poolSize))) then
+        return openConnection(client)
+    end
+
+    if (not best.ready) then
+        table.insert(best.readyWaiters, scheduler.threadCtx())
+        while ((not best.ready)and(not best.broken)) do
+            scheduler.suspend()
+        end
+        if (best.broken) then
+            error(best.broken, 0)
+        end
+    end
+    return best
+end
+
+local clientMethods = {}
+
+-- Executes a Redis command like client:call("SET", "key", "value"). Returns the reply, or nil
+-- followed by error message if Redis returned an error reply. Null replies are returned as nil
+-- at the top level and as luaw_redis_lib.null inside arrays and maps. Raises error on connection
+-- failure or timeout.
+clientMethods.call = function(client, ...)
+    local rc = getConnection(client)
+    return awaitReply(rc, send(rc, ...))
+end
+
+clientMethods.close = function(client)
+    local pool = client.pool
+    while (#pool > 0) do
+        failConnection(pool[#pool], "Redis client closed")
+    end
+end
+
+-- client configuration, unset ones must read as nil instead of turning into command shortcuts
+local configFields = {
+    hostName = true, hostIP = true, port = true, username = true, password = true, db = true,
+    protocol = true, poolSize = true, connectTimeout = true, readTimeout = true, writeTimeout = true,
+    pool = true
+}
+
+-- client:get(key), client:hset(key, field, value) etc. are shortcuts for client:call("GET", key)...
+local clientMT = {}
+
+clientMT.__index = function(client, name)
+    local method = clientMethods[name]
+    if ((method)or(configFields[name])or(type(name) ~= 'string')) then
+        return method
+    end
+
+    local cmd = string.upper(name)
+    method = function(client, ...)
+        return client:call(cmd, ...)
+    end
+    clientMethods[name] = method
+    return method
+end
+
+luaw_redis_lib.newClient = function(config)
+    config = config or {}
+    assert((config.hostName or config.hostIP), "Either hostName or hostIP must be specified for Redis client")
+
+    local client = {
+        hostName = config.hostName,
+        hostIP = config.hostIP,
+        port = config.port or DEFAULT_REDIS_PORT,
+        username = config.username,
+        password = config.password,
+        db = config.db,
+        protocol = config.protocol or 2,
+        poolSize = config.poolSize or REDIS_POOL_SIZE,
+        connectTimeout = config.connectTimeout,
+        readTimeout = config.readTimeout,
+        writeTimeout = config.writeTimeout,
+        pool = {}
+    }
+    setmetatable(client, clientMT)
+    return client
+end
+
+return luaw_redis_lib
@@ -28,10 +28,10 @@ local logging = require('luaw_logging')
 local scheduler = {}
 
 -- Constants
-local TS_RUNNABLE = constants.RUNNABLE
-local TS_DONE = constants.DONE
-local TS_BLOCKED_EVENT = constants.BLOCKED_ON_EVENT
-local TS_BLOCKED_THREAD = constants.BLOCKED_ON_THREAD
+local TS_RUNNABLE = constants.TS_RUNNABLE
+local TS_DONE = constants.TS_DONE
+local TS_BLOCKED_EVENT = constants.TS_BLOCKED_EVENT
+local TS_BLOCKED_THREAD = constants.TS_BLOCKED_THREAD
 local END_OF_CALL = constants.END_OF_CALL
 local END_OF_THREAD = constants.END_OF_THREAD
 
@@ -79,6 +79,18 @@ local function threadRunLoop(fn, arg1, arg2, arg3, arg4)
     return END_OF_THREAD, fn(arg1, arg2, arg3, arg4)
 end
 
+local unpack = unpack or table.unpack
+
+-- Keeps all the values returned by user thread function when there are more than one of them,
+-- threadCtx.result only gets the first one
+local function keepResults(threadCtx, ...)
+    local count = select('#', ...)
+    if (count > 1) then
+        threadCtx.results = { n = count, ... }
+    end
+    return ...
+end
+
 local function userThreadRunner(userThreadFn, ...)
     -- We have captured user thread function along with its arguments on a coroutine stack.
     -- Yield now so that scheduler can add this thread in run queue for "bottom half"
@@ -86,7 +98,7 @@ local function userThreadRunner(userThreadFn, ...)
     coroutine.yield(TS_RUNNABLE)
     -- At this point we have been resumed by thread scheduler during the "bottom half" run
     -- queue processing bu the scheduler so run the actual user thread function.
-    return userThreadFn(...)
+    return keepResults(currentRunningThreadCtx, userThreadFn(...))
 end
 
 local function addToRunQueue(threadCtx)
@@ -114,21 +126,30 @@ local function newThread()
     return threadCtx
 end
 
-local function unblockJoinedThreadIfAny(threadCtx, status, retVal)
-    local joinedTC = threadCtx.joinedBy
-    if joinedTC then
-        local count = joinedTC.joinCount
-        count = count -1
-        joinedTC.joinCount = count
-        if (count <= 0) then
-            addToRunQueue(joinedTC)
+-- Adds thread blocked in scheduler.suspend() back to the run queue. Waking up a thread that is
+-- not suspended is a no-op.
+local function wakeUp(threadCtx)
+    if ((threadCtx)and(threadCtx.state == TS_BLOCKED_THREAD)) then
+        addToRunQueue(threadCtx)
+    end
+end
+
+local function unblockJoinedThreadIfAny(threadCtx)
+    local joiningTC = threadCtx.joinedBy
+    if joiningTC then
+        threadCtx.joinedBy = nil
+        local count = joiningTC.joinCount - 1
+        joiningTC.joinCount = count
+        if (count == 0) then
+            wakeUp(joiningTC)
         end
     end
 end
 
-local function afterResume(threadCtx, state, retVal)
+local function afterResume(threadCtx, state, retVal, callerCtx)
     threadCtx.state, threadCtx.result = state, retVal
-    currentRunningThreadCtx = nil
+    -- restore thread that resumed this thread, if any (nested resume from within a thread)
+    currentRunningThreadCtx = callerCtx
     if (state == TS_DONE) then
         return true, retVal
     end
@@ -136,6 +157,10 @@ local function afterResume(threadCtx, state, retVal)
 end
 
 local function resumeThread(threadCtx, ...)
+    -- A thread may get resumed from within another running thread, for example when it
+    -- closes a connection or stops a timer the other thread is blocked on. Remember the
+    -- resuming thread so that we can restore it as the current thread afterwards.
+    local callerCtx = currentRunningThreadCtx
     currentRunningThreadCtx = threadCtx
     local t = threadCtx.thread
     local tid = threadCtx.tid
@@ -144,11 +169,12 @@ local function resumeThread(threadCtx, ...)
 
     context = threadCtx.requestCtx  -- TLS, per thread context
     local status, state, retVal = coroutine.resume(t, ...)
-    context = nil -- reset TLS context
+    context = callerCtx and callerCtx.requestCtx -- reset TLS context
 
     if not status then
         -- thread ran into error
         print("Error: "..tostring(state))
+        threadCtx.error = state
         state = END_OF_THREAD
         -- thread has blown its stack so let it get garbage collected
         t = nil
@@ -162,18 +188,19 @@ local function resumeThread(threadCtx, ...)
             -- thread is still alive, return it to free pool if possible
             threadPool:offer(t)
         end
-        unblockJoinedThreadIfAny(threadCtx, status, retVal)
-        return afterResume(threadCtx, TS_DONE, retVal)
+        local isDone, result = afterResume(threadCtx, TS_DONE, retVal, callerCtx)
+        unblockJoinedThreadIfAny(threadCtx)
+        return isDone, result
     end
 
     if ((state == TS_BLOCKED_EVENT)or(state == TS_BLOCKED_THREAD)) then
-        -- thread will later be resumed by libuv call back
-        return afterResume(threadCtx, state, retVal)
+        -- thread will later be resumed by libuv call back or woken up by another thread
+        return afterResume(threadCtx, state, retVal, callerCtx)
     end
 
     -- Thread yielded, but is still runnable. Add it back to the run queue
     addToRunQueue(threadCtx)
-    return afterResume(threadCtx, TS_RUNNABLE, retVal)
+    return afterResume(threadCtx, TS_RUNNABLE, retVal, callerCtx)
 end
 
 function resumeThreadId(tid, ...)
@@ -202,25 +229,140 @@ scheduler.startUserThread = function(userThreadFn, ...)
     return backgroundThreadCtx;
 end
 
+-- returns current running thread's context
+scheduler.threadCtx = function()
+    return currentRunningThreadCtx
+end
+
+-- Blocks current thread till some other thread wakes it up by calling scheduler.wakeUp()
+-- on its thread context. Callers should re-check the condition they are waiting on after
+-- returning from suspend() as the thread may be woken up for other reasons as well.
+scheduler.suspend = function()
+    assert(currentRunningThreadCtx, "scheduler.suspend() called outside of a Luaw thread")
+    coroutine.yield(TS_BLOCKED_THREAD)
+end
+
+scheduler.wakeUp = wakeUp
+
+-- Returns all the values returned by the function of the finished user thread
+local function threadResults(threadCtx)
+    local packed = threadCtx.results
+    if (packed) then
+        return unpack(packed, 1, packed.n)
+    end
+    return threadCtx.result
+end
+
+scheduler.results = threadResults
+
+local function isDone(threadCtx)
+    return ((not threadCtx)or(threadCtx.state == TS_DONE))
+end
+
+-- Blocks current thread till joinCount of threads it has joined have finished
+local function waitForJoined(joiningTC, count)
+    joiningTC.joinCount = count
+    while (joiningTC.joinCount > 0) do
+        coroutine.yield(TS_BLOCKED_THREAD)
+    end
+end
+
+local function joinThreads(joiningTC, threads, count)
+    local running = 0
+    for i=1, count do
+        local joinedTC = threads[i]
+        if (not isDone(joinedTC)) then
+            running = running + 1
+            joinedTC.joinedBy = joiningTC
+        end
+    end
+    waitForJoined(joiningTC, running)
+end
+
+local function startThreads(...)
+    local threads = {}
+    for i=1, select('#', ...) do
+        local fn = select(i, ...)
+        assert(type(fn) == 'function', "argument #"..i.." is not a function")
+        threads[i] = scheduler.startUserThread(fn)
+    end
+    return threads
+end
+
+-- Waits till all threads represented by thread contexts passed in have finished. Returns all the
+-- values returned by the first thread's function, for the common case of joining a single thread
 scheduler.join = function(...)
     local joiningTC = currentRunningThreadCtx
-    if (joininTC) then
-        local joinedThreads = table.pack(...)
-        local numOfThreads = #joinedThreads
+    if (joiningTC) then
+        joinThreads(joiningTC, {...}, select('#', ...))
+    end
+    local threadCtx = ...
+    if ((threadCtx)and(threadCtx.state == TS_DONE)) then
+        return threadResults(threadCtx)
+    end
+end
 
-        local count = 0
+--[[ Runs all functions passed in parallel as user threads and blocks the calling thread till
+all of them finish. Returns three tables indexed by the position of the function in the argument
+list: first value returned by each function, errors raised by them and their thread contexts. Errors
+table is nil if none of the functions failed. All the values returned by a function are available
+from scheduler.results() of its thread context.
+]]
+scheduler.all = function(...)
+    local joiningTC = assert(currentRunningThreadCtx, "scheduler.all() called outside of a Luaw thread")
+    local count = select('#', ...)
+    local threads = startThreads(...)
+    joinThreads(joiningTC, threads, count)
+
+    local results, errors = {}, nil
+    for i=1, count do
+        local threadCtx = threads[i]
+        results[i] = threadCtx.result
+        if (threadCtx.error) then
+            errors = errors or {}
+            errors[i] = threadCtx.error
+        end
+    end
+    return results, errors, threads
+end
 
-        for i, joinedTC in ipairs(joinedThreads) do
-            if ((joinedTC)and(joinedTC.state)and(joinedTC.state ~= TS_DONE)) then
-                count = count + 1
-                joinedTC.joinedBy = joiningTC
+--[[ Runs all functions passed in parallel as user threads and blocks the calling thread till
+the first of them finishes successfully. Returns position of that function in the argument list
+along with all the values it returned. If all functions fail, returns nil and a table of errors
+indexed by the position of the function in the argument list. Threads still running when any()
+returns are left to run to completion in background.
+]]
+scheduler.any = function(...)
+    local joiningTC = assert(currentRunningThreadCtx, "scheduler.any() called outside of a Luaw thread")
+    local threads = startThreads(...)
+    local errors = {}
+
+    while true do
+        local running = 0
+        for i, threadCtx in ipairs(threads) do
+            if (isDone(threadCtx)) then
+                if (not threadCtx.error) then
+                    -- detach ourselves from threads that are still running
+                    for j, runningTC in ipairs(threads) do
+                        if (runningTC.joinedBy == joiningTC) then
+                            runningTC.joinedBy = nil
+                        end
+                    end
+                    return i, threadResults(threadCtx)
+                end
+                errors[i] = threadCtx.error
+            else
+                running = running + 1
+                threadCtx.joinedBy = joiningTC
             end
         end
 
-        joiningTC.joinCount = count
-        while (joiningTC.joinCount > 0) do
-            coroutine.yield(TS_BLOCKED_THREAD)
+        if (running == 0) then
+            return nil, errors
         end
+
+        -- wake up as soon as any one of the running threads finishes
+        waitForJoined(joiningTC, 1)
     end
 end
 
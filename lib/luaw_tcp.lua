@@ -23,6 +23,7 @@ SOFTWARE.
 local constants = require('luaw_constants')
 local scheduler = require('luaw_scheduler')
 
+local TS_BLOCKED_EVENT = constants.TS_BLOCKED_EVENT
 local DEFAULT_CONNECT_TIMEOUT = constants.DEFAULT_CONNECT_TIMEOUT
 local DEFAULT_READ_TIMEOUT = constants.DEFAULT_READ_TIMEOUT
 local DEFAULT_WRITE_TIMEOUT = constants.DEFAULT_WRITE_TIMEOUT
@@ -34,14 +35,18 @@ conn:close()
 local startReadingInternal = connMT.startReading
 local readInternal = connMT.read
 local writeInternal = connMT.write
+local closeInternal = connMT.close
+local lingerCloseInternal = connMT.lingerClose
 
 connMT.startReading = function(self)
     local status, mesg = startReadingInternal(self)
     assert(status, mesg)
 end
 
-connMT.read = function(self, readTimeout)
-    local status, str = readInternal(self, scheduler.tid(), readTimeout or DEFAULT_READ_TIMEOUT)
+-- requestStart = true means caller waits for a new HTTP request, requests for static routes that
+-- arrive meanwhile are answered by C without returning them
+connMT.read = function(self, readTimeout, requestStart)
+    local status, str = readInternal(self, scheduler.tid(), readTimeout or DEFAULT_READ_TIMEOUT, requestStart)
     if ((status)and(not str)) then
         -- nothing in buffer, wait for libuv on_read callback
         status, str = coroutine.yield(TS_BLOCKED_EVENT)
@@ -49,8 +54,9 @@ connMT.read = function(self, readTimeout)
     return status, str
 end
 
-connMT.write = function(self, str, writeTimeout)
-    local status, nwritten = writeInternal(self, scheduler.tid(), str, writeTimeout  or DEFAULT_WRITE_TIMEOUT)
+-- chunked = true frames str as a HTTP chunk, lastChunk = true adds terminating chunk after it
+connMT.write = function(self, str, writeTimeout, chunked, lastChunk)
+    local status, nwritten = writeInternal(self, scheduler.tid(), str, writeTimeout  or DEFAULT_WRITE_TIMEOUT, chunked, lastChunk)
     if ((status)and(nwritten > 0)) then
         -- there is something to write, yield for libuv callback
         status, nwritten = coroutine.yield(TS_BLOCKED_EVENT)
@@ -59,6 +65,18 @@ connMT.write = function(self, str, writeTimeout)
     return nwritten
 end
 
+connMT.close = function(self)
+    -- threads other than the calling thread that are blocked on this connection are resumed
+    -- with an error
+    closeInternal(self, scheduler.tid())
+end
+
+-- Like close() but lets the response already written reach the peer even if the peer is still
+-- sending the request body, which would otherwise reset the connection
+connMT.lingerClose = function(self)
+    lingerCloseInternal(self, scheduler.tid())
+end
+
 local connectInternal = luaw_tcp_lib.connect
 
 local function connect(hostIP, hostName, port, connectTimeout)
@@ -22,6 +22,11 @@ SOFTWARE.
 
 local luaw_utils_lib = require("luaw_utils")
 local luaw_http_lib = require("luaw_http")
+local constants = require("luaw_constants")
+local scheduler = require("luaw_scheduler")
+
+local SERVER_PIPELINING = constants.SERVER_PIPELINING
+local SERVER_PIPELINE_DEPTH = constants.SERVER_PIPELINE_DEPTH
 
 local HTTP_METHODS = {
     GET = "GET",
@@ -278,19 +283,98 @@ local function registerResource(resource)
 
     assert(route, "Could not register handler for path "..path)
     assert((not route[method]), 'Handler already registered for '..method..' for path "/'..webapp.path..'/'..path..'"')
-    route[method] = {handler = handlerFn}
+    route[method] = {handler = handlerFn, precheck = resource.precheck}
+end
+
+--[[ Static handlers always send the same response. It is serialized once and requests for it are
+answered straight from C as they are read, the Lua handler registered along with it serves the
+requests C leaves alone - HTTP/1.0 or Connection: close requests, pipelined mode etc.
+]]
+local function registerStaticResource(resource)
+    local path = assert(resource.path , "Handler definition is missing value for 'path'")
+    local method = resource.method or 'GET'
+    if ((not HTTP_METHODS[method])or(method == 'SERVICE')) then
+        error(method.." is not a valid HTTP method for a static handler")
+    end
+    local status = resource.status or 200
+    local headers = resource.headers or {}
+    local body = tostring(resource.body or '')
+
+    local staticHeaders = {}
+    for name, value in pairs(headers) do
+        staticHeaders[name] = value
+    end
+    staticHeaders['Content-Length'] = #body
+
+    local relativePath = string.gsub(path, "^/+", "")
+    local fullPath = (webapp.path == '/') and ('/'..relativePath) or ('/'..webapp.path..'/'..relativePath)
+    luaw_http_lib.addStaticRoute(method, fullPath, {status = status, headers = staticHeaders, body = body})
+
+    registerResource {
+        method = method,
+        path = path,
+        handler = function(req, resp)
+            resp:setStatus(status)
+            for name, value in pairs(headers) do
+                resp:addHeader(name, value)
+            end
+            resp:appendBody(body)
+        end
+    }
+end
+
+--[[ Expect: 100-continue. Clients uploading big bodies may ask whether the server would accept the
+request before sending its body. Request is turned down right away if no handler is registered for it
+or if the handler's optional precheck(req, pathParams) function returns a HTTP error status, optionally
+followed by a message to send as response body. Otherwise client gets "100 Continue".
+]]
+local function checkExpectation(req)
+    local parsedURL = req.parsedURL
+    if (not((req.method)and(parsedURL)and(parsedURL.path))) then
+        return true
+    end
+
+    local webApp, action, pathParams = findAction(req.method, parsedURL.path)
+    if (not action) then
+        req.luaw_reject_status = 404
+        return false
+    end
+
+    local precheck = action.precheck
+    if (precheck) then
+        local status, mesg = precheck(req, pathParams)
+        if ((type(status) == 'number')and(status >= 400)) then
+            req.luaw_reject_status = status
+            req.luaw_reject_mesg = mesg
+            return false
+        end
+    end
+    return true
+end
+
+local function rejectRequest(req, resp)
+    resp:setStatus(req.luaw_reject_status or 417)
+    resp:addHeader('Connection', 'close')
+    if (req.luaw_reject_mesg) then
+        resp:appendBody(tostring(req.luaw_reject_mesg))
+    end
+    resp:flush()
 end
 
 local function serviceHTTP(conn)
     conn:startReading()
+    local req, resp
 
     -- loop to support HTTP 1.1 persistent (keep-alive) connections
     while true do
-        local req = luaw_http_lib.newServerHttpRequest(conn)
+        -- request and response objects are recycled by all the requests on the connection
+        req = luaw_http_lib.newServerHttpRequest(conn, req)
+        req.luaw_static_routes = true
 
         -- read and parse full request
-        local status, errmesg = pcall(req.readFull, req)
+        local status, errmesg = pcall(req.readFull, req, checkExpectation)
         if ((not status)or(req.EOF == true)) then
+            req:releaseBody()
             conn:close()
             if (status) then
                 return "read time out"
@@ -299,8 +383,19 @@ local function serviceHTTP(conn)
             return "connection reset by peer"
         end
 
-        local resp = luaw_http_lib.newServerHttpResponse(conn)
+        resp = luaw_http_lib.newServerHttpResponse(conn, resp)
+        resp.luaw_accept_encoding = req.headers['Accept-Encoding']
+        resp.luaw_if_none_match = req.headers['If-None-Match']
+
+        if (req.luaw_expectation_failed) then
+            -- request body was never read, connection can't be used for the next request
+            pcall(rejectRequest, req, resp)
+            conn:lingerClose()
+            return "expectation failed"
+        end
+
         local status, errMesg = pcall(dispatchAction, req, resp)
+        req:releaseBody()
 
         if (not status) then
             -- send HTTP error response
@@ -319,6 +414,103 @@ local function serviceHTTP(conn)
     end
 end
 
+-- services one of the pipelined requests on its own thread, response goes through its queue slot
+local function servicePipelinedRequest(queue, slot, req)
+    local resp = luaw_http_lib.newServerHttpResponse(slot)
+    resp.luaw_accept_encoding = req.headers['Accept-Encoding']
+    resp.luaw_if_none_match = req.headers['If-None-Match']
+    local status, errMesg = pcall(dispatchAction, req, resp)
+    req:releaseBody()
+
+    if (not status) then
+        print("Error: ", errMesg)
+        resp:setStatus(req.luaw_reject_status or 500)
+        resp:addHeader('Connection', 'close')
+        pcall(resp.appendBody, resp, errMesg)
+        pcall(resp.flush, resp)
+        queue.closing = true
+    elseif (req:shouldCloseConnection() or resp:shouldCloseConnection()) then
+        queue.closing = true
+    end
+    queue:complete(slot)
+end
+
+local function canReadAhead(queue)
+    return ((queue.closing)or(queue.inFlight < SERVER_PIPELINE_DEPTH))
+end
+
+local function allSent(queue)
+    return (queue.inFlight == 0)
+end
+
+--[[
+Pipelined version of serviceHTTP(). Connection's thread only reads and parses requests, each of
+them is dispatched to a new thread as soon as it is read so that handlers of the pipelined requests
+run concurrently. Responses are sent in the request order through the connection's response queue.
+]]
+local function servicePipelinedHTTP(conn)
+    conn:startReading()
+    local queue = luaw_http_lib.newResponseQueue(conn)
+    local req
+
+    -- "100 Continue" must not overtake responses to the requests before this one
+    local function checkPipelinedExpectation(req)
+        queue:waitUntil(allSent)
+        return checkExpectation(req)
+    end
+
+    while true do
+        queue:waitUntil(canReadAhead)
+        if (queue.closing) then break end
+
+        local prevReq = req
+        req = luaw_http_lib.newServerHttpRequest(conn)
+        req.luaw_pipelined = true
+        if (prevReq) then
+            req.luaw_read_content = prevReq.luaw_read_content
+            req.luaw_read_offset = prevReq.luaw_read_offset
+        end
+
+        local status, errmesg = pcall(req.readFull, req, checkPipelinedExpectation)
+        if ((not status)or(req.EOF == true)) then
+            req:releaseBody()
+            if (req.luaw_reject_status) then
+                -- request over configured limits, rejection goes out after the responses before it
+                local slot = queue:add()
+                pcall(rejectRequest, req, luaw_http_lib.newServerHttpResponse(slot))
+                queue:complete(slot)
+            elseif (not status) then
+                print("Error: ", errmesg)
+            end
+            break
+        end
+
+        if (req.luaw_expectation_failed) then
+            -- all the earlier responses are sent by now, so rejection can go out directly
+            pcall(rejectRequest, req, luaw_http_lib.newServerHttpResponse(conn))
+            break
+        end
+
+        local slot = queue:add()
+        scheduler.startUserThread(servicePipelinedRequest, queue, slot, req)
+
+        if (not req.luaw_mesg_done) then
+            -- streaming (multipart) request, its handler reads rest of the body from the connection
+            -- so we can't read the next request till it is done
+            queue:waitUntil(function() return slot.done end)
+        end
+    end
+
+    queue.closing = true
+    queue:waitUntil(allSent)
+    if ((req)and((req.luaw_reject_status)or(req.luaw_expectation_failed))) then
+        -- unread request body must not reset the connection under the rejection
+        conn:lingerClose()
+    else
+        conn:close()
+    end
+end
+
 local function toFullPath(appRoot, files)
     local fullPaths = {}
     if files then
@@ -357,6 +549,16 @@ local function loadWebApp(appName, appDir)
     end
     app.views = views
 
+    -- gzipped siblings of static files, served as is to clients accepting gzip
+    local precompressed = {}
+    for _, gzPath in ipairs(findFiles(app.appRoot, "%.gz$", {})) do
+        local path = string.sub(gzPath, 1, -4)
+        if (lfs.attributes(path, 'mode') == 'file') then
+            table.insert(precompressed, path)
+        end
+    end
+    app.precompressed = precompressed
+
     return app
 end
 
@@ -390,12 +592,20 @@ local function loadView(viewPath, buff)
 end
 
 local function startWebApp(app)
+    for i, path in ipairs(app.precompressed) do
+        luaw_http_lib.addPrecompressed(path)
+    end
+    if (#app.precompressed > 0) then
+        luaw_utils_lib.formattedLine("#Found "..#app.precompressed.." precompressed files\n")
+    end
+
     -- register resources
     local resources = app.resources
     for i,resource in ipairs(resources) do
         luaw_utils_lib.formattedLine(".Loading resource "..resource)
-        -- declare globals (registerHandler and webapp) for the duration of the loadfile(resource)
+        -- declare globals (registerHandler, registerStaticHandler and webapp) for the duration of the loadfile(resource)
         registerHandler = registerResource
+        registerStaticHandler = registerStaticResource
         webapp = app
         local routeDefn = assert(loadfile(resource), string.format("Could not load resource %s", resource))
         routeDefn()
@@ -452,7 +662,11 @@ local function init()
 end
 
 -- install REST HTTP app handler as a default request handler
-luaw_http_lib.request_handler = serviceHTTP
+if (SERVER_PIPELINING) then
+    luaw_http_lib.request_handler = servicePipelinedHTTP
+else
+    luaw_http_lib.request_handler = serviceHTTP
+end
 
 return {
     init = init,
@@ -31,6 +31,7 @@
 #include "uv.h"
 #include "luaw_common.h"
 #include "lua_lpack.h"
+#include "luaw_buffer.h"
 
 
 static void be16(const char* in, char * out) {
@@ -245,8 +246,10 @@ LUA_LIB_METHOD int serialize_write_Q(lua_State* L) {
         return luaL_error(L, "Invalid write buffer length specified");
     }
 
+    /* serialize straight into the output buffer if one is given, otherwise into a new string */
+    luaw_buffer_t* out = to_buffer(L, 3);
     const int buffsize = len + 64;
-    char* buff = (char*) malloc(buffsize);
+    char* buff = (out != NULL) ? reserve_buffer(out, buffsize) : (char*) malloc(buffsize);
     if (buff == NULL) {
         return luaL_error(L, "Could not allocate memory for serialize_write_Q");
     }
@@ -397,6 +400,10 @@ LUA_LIB_METHOD int serialize_write_Q(lua_State* L) {
         }
     }
 
+    if (out != NULL) {
+        out->len += pos;
+        return 0;
+    }
     lua_pushlstring(L, buff, pos);
     free(buff);
     return 1;
@@ -0,0 +1,388 @@
+/*
+* Copyright (c) 2015 raksoras
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "uv.h"
+#include "luaw_common.h"
+#include "luaw_buffer.h"
+
+/* returns buffer represented by the Lua value at idx, NULL if it is not a buffer */
+luaw_buffer_t* to_buffer(lua_State* L, int idx) {
+    luaw_buffer_t* buff = NULL;
+    luaw_buffer_t* ud = lua_touserdata(L, idx);
+    if ((ud != NULL)&&(lua_getmetatable(L, idx))) {
+        luaL_getmetatable(L, LUA_BUFFER_META_TABLE);
+        if (lua_rawequal(L, -1, -2)) buff = ud;
+        lua_pop(L, 2);
+    }
+    return buff;
+}
+
+/* makes room for len more bytes, growing the buffer geometrically. Returns where to write them,
+ * NULL if memory could not be allocated */
+char* reserve_buffer(luaw_buffer_t* buff, size_t len) {
+    size_t needed = buff->len + len;
+    if (needed > buff->capacity) {
+        size_t capacity = (buff->capacity > 0) ? buff->capacity : BUFFER_MIN_CAPACITY;
+        while (capacity < needed) capacity *= 2;
+        char* base = realloc(buff->base, capacity);
+        if (base == NULL) return NULL;
+        buff->base = base;
+        buff->capacity = capacity;
+    }
+    return buff->base + buff->len;
+}
+
+static void append_string(lua_State* L, luaw_buffer_t* buff, const char* str, size_t len) {
+    char* dest = reserve_buffer(buff, len);
+    if (dest == NULL) {
+        raise_lua_error(L, "Could not allocate memory for buffer");
+        return;
+    }
+    memcpy(dest, str, len);
+    buff->len += len;
+}
+
+static void append_number(lua_State* L, luaw_buffer_t* buff, lua_Number n) {
+    char str[32];
+    int len;
+    if ((n == floor(n))&&(fabs(n) < 1e15)) {
+        len = snprintf(str, sizeof(str), "%lld", (long long)n);
+    } else {
+        len = snprintf(str, sizeof(str), "%.14g", n);
+    }
+    append_string(L, buff, str, len);
+}
+
+static void append_value(lua_State* L, luaw_buffer_t* buff, int idx) {
+    size_t len = 0;
+    const char* str;
+
+    switch(lua_type(L, idx)) {
+        case LUA_TSTRING:
+            str = lua_tolstring(L, idx, &len);
+            append_string(L, buff, str, len);
+            break;
+
+        case LUA_TNUMBER:
+            append_number(L, buff, lua_tonumber(L, idx));
+            break;
+
+        case LUA_TNIL:
+            break;
+
+        case LUA_TBOOLEAN:
+            if (lua_toboolean(L, idx)) {
+                append_string(L, buff, "true", 4);
+            } else {
+                append_string(L, buff, "false", 5);
+            }
+            break;
+
+        default: {
+            luaw_buffer_t* other = to_buffer(L, idx);
+            if (other == NULL) {
+                raise_lua_error(L, "Can not append %s to buffer", luaL_typename(L, idx));
+                return;
+            }
+            if (other->len > 0) {
+                /* reserve first, other may be this very buffer */
+                if (reserve_buffer(buff, other->len) == NULL) {
+                    raise_lua_error(L, "Could not allocate memory for buffer");
+                    return;
+                }
+                memcpy(buff->base + buff->len, other->base, other->len);
+                buff->len += other->len;
+            }
+        }
+    }
+}
+
+/* XXH64, the 64 bit variant of xxHash by Yann Collet. Fast non-cryptographic hash used for ETags */
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t xxh_read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static uint32_t xxh_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = XXH_ROTL64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t luaw_xxh64(const void* input, size_t len, uint64_t seed) {
+    const uint8_t* p = input;
+    const uint8_t* end = p + len;
+    uint64_t h64;
+
+    if (len >= 32) {
+        const uint8_t* limit = end - 32;
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+        do {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h64 = XXH_ROTL64(v1, 1) + XXH_ROTL64(v2, 7) + XXH_ROTL64(v3, 12) + XXH_ROTL64(v4, 18);
+        h64 = xxh_merge_round(h64, v1);
+        h64 = xxh_merge_round(h64, v2);
+        h64 = xxh_merge_round(h64, v3);
+        h64 = xxh_merge_round(h64, v4);
+    } else {
+        h64 = seed + XXH_PRIME64_5;
+    }
+
+    h64 += (uint64_t)len;
+
+    while (p + 8 <= end) {
+        h64 ^= xxh_round(0, xxh_read64(p));
+        h64 = XXH_ROTL64(h64, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h64 ^= (uint64_t)xxh_read32(p) * XXH_PRIME64_1;
+        h64 = XXH_ROTL64(h64, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h64 ^= (*p) * XXH_PRIME64_5;
+        h64 = XXH_ROTL64(h64, 11) * XXH_PRIME64_1;
+        p++;
+    }
+
+    h64 ^= h64 >> 33;
+    h64 *= XXH_PRIME64_2;
+    h64 ^= h64 >> 29;
+    h64 *= XXH_PRIME64_3;
+    h64 ^= h64 >> 32;
+    return h64;
+}
+
+/* Lua call spec: hex = luaw_buffer_lib.hash(v, seed)
+ * Returns XXH64 hash of string or buffer v as 16 hex digits. Optional integer seed defaults to 0.
+ */
+LUA_LIB_METHOD static int buffer_hash(lua_State* L) {
+    size_t len = 0;
+    const char* str;
+    luaw_buffer_t* buff = to_buffer(L, 1);
+    if (buff != NULL) {
+        str = buff->base;
+        len = buff->len;
+    } else {
+        str = luaL_checklstring(L, 1, &len);
+    }
+    uint64_t seed = (uint64_t)luaL_optinteger(L, 2, 0);
+
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)luaw_xxh64((len > 0) ? str : "", len, seed));
+    lua_pushlstring(L, hex, 16);
+    return 1;
+}
+
+/* Lua call spec: buffer = luaw_buffer_lib.newBuffer(capacity) */
+LUA_LIB_METHOD static int new_buffer(lua_State* L) {
+    size_t capacity = luaL_optinteger(L, 1, 0);
+    luaw_buffer_t* buff = lua_newuserdata(L, sizeof(luaw_buffer_t));
+    buff->base = NULL;
+    buff->len = 0;
+    buff->capacity = 0;
+    luaL_setmetatable(L, LUA_BUFFER_META_TABLE);
+
+    if ((capacity > 0)&&(reserve_buffer(buff, capacity) == NULL)) {
+        return raise_lua_error(L, "Could not allocate memory for buffer");
+    }
+    return 1;
+}
+
+/* Lua call spec: len = buffer:append(v1, v2, ...)
+ * Appends strings, numbers, booleans and other buffers, nil values are ignored. Returns new length.
+ */
+LUA_OBJ_METHOD static int buffer_append(lua_State* L) {
+    luaw_buffer_t* buff = luaL_checkudata(L, 1, LUA_BUFFER_META_TABLE);
+    int top = lua_gettop(L);
+    for (int i = 2; i <= top; i++) {
+        append_value(L, buff, i);
+    }
+    lua_pushinteger(L, buff->len);
+    return 1;
+}
+
+/* Lua call spec: len = buffer:appendf(format, ...), same formats as string.format() */
+LUA_OBJ_METHOD static int buffer_appendf(lua_State* L) {
+    luaw_buffer_t* buff = luaL_checkudata(L, 1, LUA_BUFFER_META_TABLE);
+    int nargs = lua_gettop(L) - 1;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 2);
+    lua_call(L, nargs, 1);
+
+    size_t len = 0;
+    const char* str = lua_tolstring(L, -1, &len);
+    append_string(L, buff, str, len);
+    lua_pushinteger(L, buff->len);
+    return 1;
+}
+
+/* Lua call spec: str = buffer:concat(), whole buffer content as a string */
+LUA_OBJ_METHOD static int buffer_concat(lua_State* L) {
+    luaw_buffer_t* buff = luaL_checkudata(L, 1, LUA_BUFFER_META_TABLE);
+    lua_pushlstring(L, (buff->len > 0) ? buff->base : "", buff->len);
+    return 1;
+}
+
+/* Lua call spec: buffer:reset(), empties the buffer keeping its memory for reuse */
+LUA_OBJ_METHOD static int buffer_reset(lua_State* L) {
+    luaw_buffer_t* buff = luaL_checkudata(L, 1, LUA_BUFFER_META_TABLE);
+    buff->len = 0;
+    if (buff->capacity > BUFFER_MAX_RETAINED_CAPACITY) {
+        free(buff->base);
+        buff->base = NULL;
+        buff->capacity = 0;
+    }
+    return 0;
+}
+
+/* Lua call spec: buffer:discard(n), removes first n bytes of the buffer */
+LUA_OBJ_METHOD static int buffer_discard(lua_State* L) {
+    luaw_buffer_t* buff = luaL_checkudata(L, 1, LUA_BUFFER_META_TABLE);
+    lua_Integer n = luaL_checkinteger(L, 2);
+    if (n <= 0) return 0;
+
+    if ((size_t)n >= buff->len) {
+        buff->len = 0;
+    } else {
+        memmove(buff->base, buff->base + n, buff->len - n);
+        buff->len -= n;
+    }
+    return 0;
+}
+
+LUA_OBJ_METHOD static int buffer_length(lua_State* L) {
+    luaw_buffer_t* buff = luaL_checkudata(L, 1, LUA_BUFFER_META_TABLE);
+    lua_pushinteger(L, buff->len);
+    return 1;
+}
+
+/* methods are looked up in the methods table, buffer.len returns current length */
+LUA_OBJ_METHOD static int buffer_index(lua_State* L) {
+    luaw_buffer_t* buff = luaL_checkudata(L, 1, LUA_BUFFER_META_TABLE);
+    size_t key_len = 0;
+    const char* key = lua_tolstring(L, 2, &key_len);
+    if ((key != NULL)&&(key_len == 3)&&(memcmp(key, "len", 3) == 0)) {
+        lua_pushinteger(L, buff->len);
+        return 1;
+    }
+    lua_pushvalue(L, 2);
+    lua_rawget(L, lua_upvalueindex(1));
+    return 1;
+}
+
+LUA_OBJ_METHOD static int buffer_gc(lua_State* L) {
+    luaw_buffer_t* buff = luaL_checkudata(L, 1, LUA_BUFFER_META_TABLE);
+    free(buff->base);
+    buff->base = NULL;
+    buff->len = 0;
+    buff->capacity = 0;
+    return 0;
+}
+
+static const struct luaL_Reg luaw_buffer_methods[] = {
+    {"append", buffer_append},
+    {"concat", buffer_concat},
+    {"reset", buffer_reset},
+    {"discard", buffer_discard},
+    {"length", buffer_length},
+    {NULL, NULL}  /* sentinel */
+};
+
+static const struct luaL_Reg luaw_buffer_lib[] = {
+    {"newBuffer", new_buffer},
+    {"hash", buffer_hash},
+    {NULL, NULL}  /* sentinel */
+};
+
+void luaw_init_buffer_lib(lua_State *L) {
+    luaL_newmetatable(L, LUA_BUFFER_META_TABLE);
+
+    /* methods table, also the upvalue of __index */
+    lua_newtable(L);
+    luaL_setfuncs(L, luaw_buffer_methods, 0);
+    lua_getglobal(L, "string");
+    lua_getfield(L, -1, "format");
+    lua_remove(L, -2);
+    lua_pushcclosure(L, buffer_appendf, 1);
+    lua_setfield(L, -2, "appendf");
+
+    lua_pushcclosure(L, buffer_index, 1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, buffer_concat);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, buffer_length);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, buffer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newlib(L, luaw_buffer_lib);
+    lua_setglobal(L, "luaw_buffer_lib");
+}
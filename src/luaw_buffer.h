@@ -0,0 +1,53 @@
+/*
+* Copyright (c) 2015 raksoras
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+#ifndef LUAW_BUFFER_H
+
+#define LUAW_BUFFER_H
+
+#include <stdint.h>
+
+#define LUA_BUFFER_META_TABLE "__luaw_buffer_MT__"
+
+/* initial capacity of a buffer */
+#define BUFFER_MIN_CAPACITY 1024
+
+/* reset() gives memory back if a buffer has grown past this, so that a buffer reused across requests
+ * doesn't hold on to the memory one unusually large response needed */
+#define BUFFER_MAX_RETAINED_CAPACITY (1024 * 1024)
+
+/* growable string builder, used to assemble message bodies without creating a Lua string per fragment */
+typedef struct {
+    char* base;
+    size_t len;
+    size_t capacity;
+}
+luaw_buffer_t;
+
+extern luaw_buffer_t* to_buffer(lua_State* L, int idx);
+extern char* reserve_buffer(luaw_buffer_t* buff, size_t len);
+extern uint64_t luaw_xxh64(const void* input, size_t len, uint64_t seed);
+extern void luaw_init_buffer_lib(lua_State *L);
+
+#endif
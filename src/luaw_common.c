@@ -35,6 +35,10 @@
 #include "luaw_tcp.h"
 #include "luaw_http_parser.h"
 #include "luaw_timer.h"
+#include "luaw_redis.h"
+#include "luaw_fs.h"
+#include "luaw_buffer.h"
+#include "luaw_compress.h"
 #include "lua_lpack.h"
 
 /* globals */
@@ -114,10 +118,14 @@ void make_metatable(lua_State *L, const char* mt_name, const luaL_Reg* mt_funcs)
 
 LUA_LIB_METHOD void luaw_init_libs (lua_State *L) {
     luaw_init_logging_lib(L);
+    luaw_init_buffer_lib(L);
+    luaw_init_compress_lib(L);
     luaw_init_tcp_lib(L);
     luaw_init_http_lib(L);
     luaw_init_timer_lib(L);
     luaw_init_lpack_lib(L);
+    luaw_init_redis_lib(L);
+    luaw_init_fs_lib(L);
 }
 
 /*********************************************************************
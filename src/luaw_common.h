@@ -101,6 +101,11 @@ extern void resume_lua_thread(lua_State* L, int nargs, int nresults, int errHand
 
 #define lua_rawlen(L, i) lua_objlen(L, i)
 
+/* Lua 5.1 has no user values, userdata environment table can stand in as long as we only store
+ * tables in it */
+#define lua_getuservalue(L, i) lua_getfenv(L, i)
+#define lua_setuservalue(L, i) lua_setfenv(L, i)
+
 #endif /* Lua 5.1 */
 
 #if !defined(LUA_VERSION_NUM) || LUA_VERSION_NUM == 501
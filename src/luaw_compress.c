@@ -0,0 +1,171 @@
+/*
+* Copyright (c) 2015 raksoras
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "uv.h"
+#include "luaw_common.h"
+#include "luaw_buffer.h"
+#include "luaw_compress.h"
+
+/* streaming gzip/deflate compressor of a single response body */
+typedef struct {
+    z_stream strm;
+    bool active;                    /* deflateInit2 succeeded and deflateEnd not called yet */
+}
+luaw_deflater_t;
+
+static void end_deflater(luaw_deflater_t* deflater) {
+    if (deflater->active) {
+        deflateEnd(&deflater->strm);
+        deflater->active = false;
+    }
+}
+
+/* Lua call spec: deflater = luaw_compress_lib.newDeflater(encoding, level)
+ * encoding is either "gzip" or "deflate" (zlib format as per HTTP), level 1-9, zlib's default if nil
+ */
+LUA_LIB_METHOD static int new_deflater(lua_State* L) {
+    const char* encoding = luaL_checkstring(L, 1);
+    int level = luaL_optinteger(L, 2, Z_DEFAULT_COMPRESSION);
+
+    int window_bits;
+    if (strcmp(encoding, "gzip") == 0) {
+        window_bits = MAX_WBITS + 16;
+    } else if (strcmp(encoding, "deflate") == 0) {
+        window_bits = MAX_WBITS;
+    } else {
+        return error_to_lua(L, "Unsupported content encoding: %s", encoding);
+    }
+
+    luaw_deflater_t* deflater = lua_newuserdata(L, sizeof(luaw_deflater_t));
+    memset(deflater, 0, sizeof(luaw_deflater_t));
+    luaL_setmetatable(L, LUA_DEFLATER_META_TABLE);
+
+    int rc = deflateInit2(&deflater->strm, level, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+    if (rc != Z_OK) {
+        return error_to_lua(L, "Could not initialize deflate stream: %s", zError(rc));
+    }
+    deflater->active = true;
+    return 1;
+}
+
+/* Lua call spec: len = deflater:compress(input, output, flush)
+ * Compresses input - a string or a buffer - appending compressed bytes to output buffer. flush is
+ * "sync" to flush all the pending output so that the client can decompress everything given so far,
+ * "finish" to end the stream, nil to let zlib hold on to the output till it has enough of it. Returns
+ * output buffer's new length. Deflater can not be used anymore after "finish".
+ */
+LUA_OBJ_METHOD static int deflater_compress(lua_State* L) {
+    luaw_deflater_t* deflater = luaL_checkudata(L, 1, LUA_DEFLATER_META_TABLE);
+    size_t len = 0;
+    const char* input = lua_tolstring(L, 2, &len);
+    luaw_buffer_t* in_buff = to_buffer(L, 2);
+    if (in_buff != NULL) {
+        input = in_buff->base;
+        len = in_buff->len;
+    }
+    if ((input == NULL)&&(in_buff == NULL)) {
+        return raise_lua_error(L, "Invalid input to compress: %s", luaL_typename(L, 2));
+    }
+
+    luaw_buffer_t* out = to_buffer(L, 3);
+    if (out == NULL) {
+        return raise_lua_error(L, "Output buffer missing");
+    }
+    if (!deflater->active) {
+        return raise_lua_error(L, "Deflate stream already finished");
+    }
+
+    int flush = Z_NO_FLUSH;
+    const char* mode = lua_tostring(L, 4);
+    if (mode != NULL) {
+        if (strcmp(mode, "sync") == 0) {
+            flush = Z_SYNC_FLUSH;
+        } else if (strcmp(mode, "finish") == 0) {
+            flush = Z_FINISH;
+        }
+    }
+
+    z_stream* strm = &deflater->strm;
+    strm->next_in = (Bytef*)input;
+    strm->avail_in = len;
+
+    while (true) {
+        char* dest = reserve_buffer(out, DEFLATE_OUTPUT_CHUNK);
+        if (dest == NULL) {
+            end_deflater(deflater);
+            return raise_lua_error(L, "Could not allocate memory for compressed output");
+        }
+        strm->next_out = (Bytef*)dest;
+        strm->avail_out = DEFLATE_OUTPUT_CHUNK;
+
+        int rc = deflate(strm, flush);
+        out->len += DEFLATE_OUTPUT_CHUNK - strm->avail_out;
+
+        if (rc == Z_STREAM_END) {
+            end_deflater(deflater);
+            break;
+        }
+        if ((rc != Z_OK)&&(rc != Z_BUF_ERROR)) {
+            end_deflater(deflater);
+            return raise_lua_error(L, "Compression failed: %s", zError(rc));
+        }
+        /* all input consumed and deflate did not fill up the output means it has nothing more to give */
+        if ((flush != Z_FINISH)&&(strm->avail_in == 0)&&(strm->avail_out > 0)) {
+            break;
+        }
+    }
+
+    strm->next_in = NULL;
+    lua_pushinteger(L, out->len);
+    return 1;
+}
+
+LUA_OBJ_METHOD static int deflater_gc(lua_State* L) {
+    luaw_deflater_t* deflater = luaL_checkudata(L, 1, LUA_DEFLATER_META_TABLE);
+    end_deflater(deflater);
+    return 0;
+}
+
+static const struct luaL_Reg luaw_deflater_methods[] = {
+    {"compress", deflater_compress},
+    {"__gc", deflater_gc},
+    {NULL, NULL}  /* sentinel */
+};
+
+static const struct luaL_Reg luaw_compress_lib[] = {
+    {"newDeflater", new_deflater},
+    {NULL, NULL}  /* sentinel */
+};
+
+void luaw_init_compress_lib(lua_State *L) {
+    make_metatable(L, LUA_DEFLATER_META_TABLE, luaw_deflater_methods);
+    luaL_newlib(L, luaw_compress_lib);
+    lua_setglobal(L, "luaw_compress_lib");
+}
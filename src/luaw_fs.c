@@ -0,0 +1,219 @@
+/*
+* Copyright (c) 2015 raksoras
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "uv.h"
+#include "luaw_common.h"
+#include "luaw_fs.h"
+
+/* Async file system operations. Every call starts libuv request on behalf of the lua thread whose id
+ * is passed in as the last argument and returns true, the thread then blocks until the request
+ * completes and resumes it with the result. See luaw_fs.lua for the blocking wrappers. */
+
+static luaw_fs_req_t* new_fs_req(lua_State* L, int tid_idx) {
+    int lua_tid = lua_tointeger(L, tid_idx);
+    if (lua_tid == 0) {
+        raise_lua_error(L, "Invalid thread id specified for file operation");
+        return NULL;
+    }
+
+    luaw_fs_req_t* fs_req = (luaw_fs_req_t*)malloc(sizeof(luaw_fs_req_t));
+    if (fs_req == NULL) {
+        raise_lua_error(L, "Could not allocate memory for file operation");
+        return NULL;
+    }
+    fs_req->req.data = fs_req;
+    fs_req->lua_tid = lua_tid;
+    fs_req->str_ref = LUA_NOREF;
+    fs_req->buff = NULL;
+    return fs_req;
+}
+
+static void free_fs_req(luaw_fs_req_t* fs_req) {
+    if (fs_req->str_ref != LUA_NOREF) {
+        luaL_unref(l_global, LUA_REGISTRYINDEX, fs_req->str_ref);
+    }
+    free(fs_req->buff);
+    free(fs_req);
+}
+
+LIBUV_CALLBACK static void on_fs_done(uv_fs_t* req) {
+    luaw_fs_req_t* fs_req = (luaw_fs_req_t*)req->data;
+    ssize_t result = req->result;
+
+    lua_rawgeti(l_global, LUA_REGISTRYINDEX, resume_thread_fn_ref);
+    lua_pushinteger(l_global, fs_req->lua_tid);
+
+    if (result < 0) {
+        lua_pushboolean(l_global, 0);
+        lua_pushstring(l_global, uv_strerror(result));
+    } else {
+        lua_pushboolean(l_global, 1);
+        switch(req->fs_type) {
+            case UV_FS_READ:
+                lua_pushlstring(l_global, fs_req->buff, result);
+                break;
+
+            case UV_FS_FSTAT:
+                lua_pushnumber(l_global, req->statbuf.st_size);
+                break;
+
+            default:
+                /* file descriptor for open, bytes written for write */
+                lua_pushinteger(l_global, result);
+        }
+    }
+
+    uv_fs_req_cleanup(req);
+    free_fs_req(fs_req);
+    resume_lua_thread(l_global, 3, 2, 0);
+}
+
+static int check_fs_start(lua_State* L, luaw_fs_req_t* fs_req, int rc) {
+    if (rc) {
+        free_fs_req(fs_req);
+        return error_to_lua(L, "File operation failed: %s", uv_strerror(rc));
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int open_flags(const char* mode) {
+    if (strcmp(mode, "r") == 0) return O_RDONLY;
+    if (strcmp(mode, "w") == 0) return O_WRONLY|O_CREAT|O_TRUNC;
+    if (strcmp(mode, "a") == 0) return O_WRONLY|O_CREAT|O_APPEND;
+    if (strcmp(mode, "r+") == 0) return O_RDWR;
+    if (strcmp(mode, "w+") == 0) return O_RDWR|O_CREAT|O_TRUNC;
+    if (strcmp(mode, "x+") == 0) return O_RDWR|O_CREAT|O_EXCL;  /* new file only, for temp files */
+    return -1;
+}
+
+/* lua call spec: status = luaw_fs_lib.open(path, mode, tid), thread resumed with status, fd */
+LUA_LIB_METHOD static int fs_open(lua_State* L) {
+    const char* path = luaL_checkstring(L, 1);
+    int flags = open_flags(luaL_checkstring(L, 2));
+    if (flags < 0) {
+        return error_to_lua(L, "Invalid file open mode: %s", lua_tostring(L, 2));
+    }
+
+    luaw_fs_req_t* fs_req = new_fs_req(L, 3);
+    int rc = uv_fs_open(uv_default_loop(), &fs_req->req, path, flags, S_IRUSR|S_IWUSR|S_IRGRP, on_fs_done);
+    return check_fs_start(L, fs_req, rc);
+}
+
+/* lua call spec: status = luaw_fs_lib.write(fd, str, offset, tid, i, j), thread resumed with status, nwritten.
+ * offset of -1 writes at the current file position. Optional i, j write only string.sub(str, i, j)
+ * without making a copy of it */
+LUA_LIB_METHOD static int fs_write(lua_State* L) {
+    uv_file fd = luaL_checkinteger(L, 1);
+    size_t len = 0;
+    const char* str = luaL_checklstring(L, 2, &len);
+    int64_t offset = luaL_optnumber(L, 3, -1);
+    lua_Integer i = luaL_optinteger(L, 5, 1);
+    lua_Integer j = luaL_optinteger(L, 6, len);
+    if (i < 1) i = 1;
+    if (j > (lua_Integer)len) j = len;
+    if (j < i) {
+        str = "";
+        len = 0;
+    } else {
+        str += i - 1;
+        len = j - i + 1;
+    }
+
+    luaw_fs_req_t* fs_req = new_fs_req(L, 4);
+    /* string is written from the thread pool, keep it alive till the write completes */
+    lua_pushvalue(L, 2);
+    fs_req->str_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    uv_buf_t buff = uv_buf_init((char*)str, len);
+    int rc = uv_fs_write(uv_default_loop(), &fs_req->req, fd, &buff, 1, offset, on_fs_done);
+    return check_fs_start(L, fs_req, rc);
+}
+
+/* lua call spec: status = luaw_fs_lib.read(fd, len, offset, tid), thread resumed with status, str.
+ * Empty string means EOF. offset of -1 reads from the current file position */
+LUA_LIB_METHOD static int fs_read(lua_State* L) {
+    uv_file fd = luaL_checkinteger(L, 1);
+    size_t len = luaL_optinteger(L, 2, FS_READ_BUFFER_SIZE);
+    int64_t offset = luaL_optnumber(L, 3, -1);
+    if ((len == 0)||(len > FS_READ_BUFFER_SIZE)) len = FS_READ_BUFFER_SIZE;
+
+    luaw_fs_req_t* fs_req = new_fs_req(L, 4);
+    fs_req->buff = (char*)malloc(len);
+    if (fs_req->buff == NULL) {
+        free_fs_req(fs_req);
+        return error_to_lua(L, "Could not allocate memory for file read");
+    }
+
+    uv_buf_t buff = uv_buf_init(fs_req->buff, len);
+    int rc = uv_fs_read(uv_default_loop(), &fs_req->req, fd, &buff, 1, offset, on_fs_done);
+    return check_fs_start(L, fs_req, rc);
+}
+
+/* lua call spec: status = luaw_fs_lib.size(fd, tid), thread resumed with status, size in bytes */
+LUA_LIB_METHOD static int fs_size(lua_State* L) {
+    uv_file fd = luaL_checkinteger(L, 1);
+    luaw_fs_req_t* fs_req = new_fs_req(L, 2);
+    int rc = uv_fs_fstat(uv_default_loop(), &fs_req->req, fd, on_fs_done);
+    return check_fs_start(L, fs_req, rc);
+}
+
+/* lua call spec: status = luaw_fs_lib.close(fd, tid), thread resumed with status */
+LUA_LIB_METHOD static int fs_close(lua_State* L) {
+    uv_file fd = luaL_checkinteger(L, 1);
+    luaw_fs_req_t* fs_req = new_fs_req(L, 2);
+    int rc = uv_fs_close(uv_default_loop(), &fs_req->req, fd, on_fs_done);
+    return check_fs_start(L, fs_req, rc);
+}
+
+/* lua call spec: status = luaw_fs_lib.unlink(path, tid), thread resumed with status */
+LUA_LIB_METHOD static int fs_unlink(lua_State* L) {
+    const char* path = luaL_checkstring(L, 1);
+    luaw_fs_req_t* fs_req = new_fs_req(L, 2);
+    int rc = uv_fs_unlink(uv_default_loop(), &fs_req->req, path, on_fs_done);
+    return check_fs_start(L, fs_req, rc);
+}
+
+static const struct luaL_Reg luaw_fs_lib[] = {
+    {"open", fs_open},
+    {"write", fs_write},
+    {"read", fs_read},
+    {"size", fs_size},
+    {"close", fs_close},
+    {"unlink", fs_unlink},
+    {NULL, NULL}  /* sentinel */
+};
+
+void luaw_init_fs_lib (lua_State *L) {
+    luaL_newlib(L, luaw_fs_lib);
+    lua_setglobal(L, "luaw_fs_lib");
+}
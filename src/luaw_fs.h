@@ -0,0 +1,42 @@
+/*
+* Copyright (c) 2015 raksoras
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#ifndef LUAW_FS_H
+
+#define LUAW_FS_H
+
+/* size of the buffer used for each file read */
+#define FS_READ_BUFFER_SIZE 65536
+
+/* file system request in flight, shared by all async file operations */
+typedef struct {
+    uv_fs_t req;
+    int lua_tid;                    /* id of the lua thread blocked on this request */
+    int str_ref;                    /* registry reference keeping the string being written alive */
+    char* buff;                     /* buffer being read into */
+}
+luaw_fs_req_t;
+
+extern void luaw_init_fs_lib(lua_State *L);
+
+#endif
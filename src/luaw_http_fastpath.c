@@ -0,0 +1,306 @@
+/*
+* Copyright (c) 2015 raksoras
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include "luaw_http_fastpath.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define FAST_HTTP_X86 1
+#include <immintrin.h>
+#endif
+
+/* Character class in a form usable by both scalar and SIMD scanners. A byte c belongs to the
+ * class if lo[c & 0xf] & hi[c >> 4] is non zero: hi maps high nibbles 0-7 to a bit each (bytes
+ * >= 0x80 never match) and lo holds the bits of allowed high nibbles for each low nibble. With
+ * pshufb this classifies 16 or 32 bytes in a handful of instructions. */
+typedef struct {
+    uint8_t lo[16];
+    uint8_t hi[16];
+    uint8_t table[256];
+}
+char_class;
+
+typedef const char* (*scan_fn)(const char* p, const char* end, const char_class* cls);
+
+static char_class token_class;     /* method and header name: RFC 7230 tchar */
+static char_class url_class;       /* visible ASCII */
+static char_class value_class;     /* visible ASCII, space and tab */
+
+static scan_fn scan = NULL;
+static fast_http_impl current_impl = FAST_HTTP_SCALAR;
+
+static const char* impl_names[] = {"scalar", "sse4.2", "avx2"};
+
+static int is_tchar(int c) {
+    if ((c >= '0')&&(c <= '9')) return 1;
+    if ((c >= 'a')&&(c <= 'z')) return 1;
+    if ((c >= 'A')&&(c <= 'Z')) return 1;
+    return ((c != 0)&&(strchr("!#$%&'*+-.^_`|~", c) != NULL));
+}
+
+static int is_url_char(int c) {
+    return ((c > 0x20)&&(c < 0x7f));
+}
+
+static int is_value_char(int c) {
+    return (((c >= 0x20)&&(c < 0x7f))||(c == '\t'));
+}
+
+static void init_class(char_class* cls, int (*allowed)(int)) {
+    memset(cls, 0, sizeof(char_class));
+    for (int h = 0; h < 8; h++) {
+        cls->hi[h] = (uint8_t)(1 << h);
+    }
+    for (int c = 0; c < 128; c++) {
+        if (allowed(c)) {
+            cls->lo[c & 0x0f] |= (uint8_t)(1 << (c >> 4));
+            cls->table[c] = 1;
+        }
+    }
+}
+
+/* returns pointer to the first byte in [p, end) that does not belong to the class, end if none */
+static const char* scan_scalar(const char* p, const char* end, const char_class* cls) {
+    while ((p < end)&&(cls->table[(uint8_t)*p])) p++;
+    return p;
+}
+
+#ifdef FAST_HTTP_X86
+
+__attribute__((target("sse4.2")))
+static const char* scan_sse42(const char* p, const char* end, const char_class* cls) {
+    const __m128i lo_lut = _mm_loadu_si128((const __m128i*)cls->lo);
+    const __m128i hi_lut = _mm_loadu_si128((const __m128i*)cls->hi);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i zero = _mm_setzero_si128();
+
+    while ((end - p) >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i lo = _mm_shuffle_epi8(lo_lut, _mm_and_si128(v, nibble));
+        __m128i hi = _mm_shuffle_epi8(hi_lut, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), zero));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_scalar(p, end, cls);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_avx2(const char* p, const char* end, const char_class* cls) {
+    const __m256i lo_lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)cls->lo));
+    const __m256i hi_lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)cls->hi));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i zero = _mm256_setzero_si256();
+
+    while ((end - p) >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        __m256i lo = _mm256_shuffle_epi8(lo_lut, _mm256_and_si256(v, nibble));
+        __m256i hi = _mm256_shuffle_epi8(hi_lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), zero));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+
+    /* finish off with 16 byte vectors here instead of calling scan_sse42(), mixing VEX and legacy
+       SSE encoded code is expensive */
+    const __m128i lo_lut16 = _mm256_castsi256_si128(lo_lut);
+    const __m128i hi_lut16 = _mm256_castsi256_si128(hi_lut);
+    const __m128i nibble16 = _mm_set1_epi8(0x0f);
+    if ((end - p) >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        __m128i lo = _mm_shuffle_epi8(lo_lut16, _mm_and_si128(v, nibble16));
+        __m128i hi = _mm_shuffle_epi8(hi_lut16, _mm_and_si128(_mm_srli_epi16(v, 4), nibble16));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128()));
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+    return scan_scalar(p, end, cls);
+}
+
+#endif
+
+int fast_http_use_impl(fast_http_impl impl) {
+    if (scan == NULL) {
+        init_class(&token_class, is_tchar);
+        init_class(&url_class, is_url_char);
+        init_class(&value_class, is_value_char);
+    }
+
+    switch (impl) {
+        case FAST_HTTP_SCALAR:
+            scan = scan_scalar;
+            break;
+
+#ifdef FAST_HTTP_X86
+        case FAST_HTTP_SSE42:
+            __builtin_cpu_init();
+            if (!__builtin_cpu_supports("sse4.2")) return 0;
+            scan = scan_sse42;
+            break;
+
+        case FAST_HTTP_AVX2:
+            __builtin_cpu_init();
+            if (!__builtin_cpu_supports("avx2")) return 0;
+            scan = scan_avx2;
+            break;
+#endif
+
+        default:
+            return 0;
+    }
+    current_impl = impl;
+    return 1;
+}
+
+void fast_http_init(void) {
+    if (!fast_http_use_impl(FAST_HTTP_AVX2)) {
+        if (!fast_http_use_impl(FAST_HTTP_SSE42)) {
+            fast_http_use_impl(FAST_HTTP_SCALAR);
+        }
+    }
+}
+
+const char* fast_http_impl_name(void) {
+    return impl_names[current_impl];
+}
+
+/* only methods that http_parser would report the same way */
+static const char* match_method(const char* m, size_t len) {
+    switch (len) {
+        case 3:
+            if (memcmp(m, "GET", 3) == 0) return "GET";
+            if (memcmp(m, "PUT", 3) == 0) return "PUT";
+            break;
+        case 4:
+            if (memcmp(m, "HEAD", 4) == 0) return "HEAD";
+            if (memcmp(m, "POST", 4) == 0) return "POST";
+            break;
+        case 5:
+            if (memcmp(m, "PATCH", 5) == 0) return "PATCH";
+            break;
+        case 6:
+            if (memcmp(m, "DELETE", 6) == 0) return "DELETE";
+            break;
+        case 7:
+            if (memcmp(m, "OPTIONS", 7) == 0) return "OPTIONS";
+            break;
+    }
+    return NULL;
+}
+
+#define NAME_IS(h, s) (((h)->name_len == sizeof(s) - 1)&&(strncasecmp((h)->name, s, sizeof(s) - 1) == 0))
+#define VALUE_IS(h, s) (((h)->value_len == sizeof(s) - 1)&&(strncasecmp((h)->value, s, sizeof(s) - 1) == 0))
+
+/* checks headers that affect framing and connection handling, returns 0 to bail out */
+static int check_special_header(fast_http_header_t* h, fast_http_request_t* req) {
+    switch (h->name_len) {
+        case 7:
+            if (NAME_IS(h, "Upgrade")) return 0;
+            break;
+
+        case 10:
+            if (NAME_IS(h, "Connection")) {
+                if (VALUE_IS(h, "close")) {
+                    req->keep_alive = 0;
+                } else if (VALUE_IS(h, "keep-alive")) {
+                    req->keep_alive = 1;
+                } else {
+                    return 0;
+                }
+            }
+            break;
+
+        case 14:
+            if (NAME_IS(h, "Content-Length")) {
+                if ((h->value_len != 1)||(h->value[0] != '0')) return 0;
+            }
+            break;
+
+        case 17:
+            if (NAME_IS(h, "Transfer-Encoding")) return 0;
+            break;
+    }
+    return 1;
+}
+
+size_t fast_parse_http_request(const char* buf, size_t len, fast_http_request_t* req) {
+    const char* p = buf;
+    const char* end = buf + len;
+
+    if (scan == NULL) fast_http_init();
+
+    /* request line */
+    const char* method_end = scan(p, end, &token_class);
+    if ((method_end >= end)||(*method_end != ' ')) return 0;
+    req->method = match_method(p, method_end - p);
+    if (req->method == NULL) return 0;
+    p = method_end + 1;
+
+    const char* url_end = scan(p, end, &url_class);
+    if ((url_end == p)||(url_end >= end)||(*url_end != ' ')) return 0;
+    req->url = p;
+    req->url_len = url_end - p;
+    p = url_end + 1;
+
+    if (((end - p) < 10)||(memcmp(p, "HTTP/1.", 7) != 0)||(p[8] != '\r')||(p[9] != '\n')) return 0;
+    if ((p[7] != '0')&&(p[7] != '1')) return 0;
+    req->http_minor = p[7] - '0';
+    req->keep_alive = req->http_minor;
+    p += 10;
+
+    /* headers */
+    req->num_headers = 0;
+    while (1) {
+        if ((end - p) < 2) return 0;
+        if (p[0] == '\r') {
+            if (p[1] != '\n') return 0;
+            p += 2;
+            break;
+        }
+        if (req->num_headers == FAST_HTTP_MAX_HEADERS) return 0;
+        fast_http_header_t* h = &req->headers[req->num_headers];
+
+        const char* name_end = scan(p, end, &token_class);
+        if ((name_end == p)||(name_end >= end)||(*name_end != ':')) return 0;
+        h->name = p;
+        h->name_len = name_end - p;
+        p = name_end + 1;
+
+        while ((p < end)&&((*p == ' ')||(*p == '\t'))) p++;
+        const char* value_end = scan(p, end, &value_class);
+        if (((end - value_end) < 3)||(value_end[0] != '\r')||(value_end[1] != '\n')) return 0;
+        h->value = p;
+        h->value_len = value_end - p;
+        p = value_end + 2;
+
+        /* obsolete line folding */
+        if ((*p == ' ')||(*p == '\t')) return 0;
+
+        if (!check_special_header(h, req)) return 0;
+        req->num_headers++;
+    }
+
+    return p - buf;
+}
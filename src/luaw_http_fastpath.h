@@ -0,0 +1,74 @@
+/*
+* Copyright (c) 2015 raksoras
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#ifndef LUAW_HTTP_FASTPATH_H
+#define LUAW_HTTP_FASTPATH_H
+
+#include <stddef.h>
+
+/* Fast path parser for the common case of small, well formed, bodiless HTTP/1.x requests. It
+ * scans request line and headers 16 or 32 bytes at a time using SSE4.2 or AVX2 when the CPU
+ * supports them. Anything it does not fully understand - incomplete requests, requests with body,
+ * upgrades, folded headers, unusual characters etc. - is left to http_parser's state machine.
+ * This file does not depend on Lua so that it can be benchmarked standalone. */
+
+#define FAST_HTTP_MAX_HEADERS 64
+
+typedef enum {
+    FAST_HTTP_SCALAR = 0,
+    FAST_HTTP_SSE42,
+    FAST_HTTP_AVX2
+}
+fast_http_impl;
+
+typedef struct {
+    const char* name;
+    size_t name_len;
+    const char* value;
+    size_t value_len;
+}
+fast_http_header_t;
+
+typedef struct {
+    const char* method;                     /* points to a static string */
+    const char* url;
+    size_t url_len;
+    int http_minor;
+    int keep_alive;
+    size_t num_headers;
+    fast_http_header_t headers[FAST_HTTP_MAX_HEADERS];
+}
+fast_http_request_t;
+
+/* picks the best implementation supported by the CPU */
+extern void fast_http_init(void);
+
+/* forces given implementation, returns 0 if it is not supported by the CPU or the build */
+extern int fast_http_use_impl(fast_http_impl impl);
+
+extern const char* fast_http_impl_name(void);
+
+/* Parses request head at the start of buf. Returns its length, including the terminating empty
+ * line, or 0 if the request must be handled by the regular parser */
+extern size_t fast_parse_http_request(const char* buf, size_t len, fast_http_request_t* req);
+
+#endif
@@ -21,8 +21,12 @@
 */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
+#include <time.h>
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -30,63 +34,359 @@
 #include "uv.h"
 #include "luaw_common.h"
 #include "luaw_http_parser.h"
+#include "luaw_http_fastpath.h"
+#include "luaw_multipart.h"
 #include "luaw_tcp.h"
 
 typedef enum {
 	PARSE_HTTP_PARSER_IDX = 1,
 	PARSE_HTTP_BUFF_IDX,
-	PARSE_HTTP_REQ_IDX,
-	PARSE_HTTP_LENGTH_IDX,
-	PARSE_HTTP_CONN_IDX
+	PARSE_HTTP_OFFSET_IDX,
+	PARSE_HTTP_REQ_IDX
 }
 parse_http_lua_stack_index;
 
-static int decode_hex_str(const char* str, int len) {
-	char *read_ptr = (char *)str;
-	char *write_ptr = (char *)str;
-	int hex_ch;
-	char ch;
-
-	while (len) {
-		ch = *read_ptr;
-		if ((ch == '%')&&(len > 2)) {
-			sscanf((read_ptr+1),"%2x", &hex_ch);
-			ch = (char)hex_ch;
-			read_ptr += 3; len -= 3;
-		}
-		else {
-			read_ptr++;	len--;
-		}
-
-		*write_ptr = ch;
-		write_ptr++;
-	}
-	return ((const unsigned char*)write_ptr - (const unsigned char*)str);
+#define ACC_HEADER_NAME "_acc_header_name_"
+#define ACC_HEADER_VALUE "_acc_header_value_"
+
+/* Well known header names in their canonical spelling, indexed by a perfect hash of the lower cased
+ * name: FNV-1a hash of the name scrambled by a multiplier that was picked offline so that none of
+ * the names below collide. Adding a new name requires searching for a new multiplier. */
+#define HEADER_NAME_SLOTS 256
+#define HEADER_NAME_HASH_MULTIPLIER 0x5349da49u
+
+static const char* well_known_header_names[HEADER_NAME_SLOTS] = {
+    [11] = "Content-Disposition",
+    [14] = "Upgrade",
+    [16] = "Keep-Alive",
+    [17] = "If-Modified-Since",
+    [20] = "Date",
+    [27] = "Upgrade-Insecure-Requests",
+    [31] = "If-Range",
+    [35] = "Forwarded",
+    [38] = "X-Real-IP",
+    [39] = "Expect",
+    [42] = "Via",
+    [45] = "Content-Encoding",
+    [48] = "X-Forwarded-For",
+    [50] = "Host",
+    [54] = "Access-Control-Request-Headers",
+    [62] = "DNT",
+    [67] = "Content-Location",
+    [70] = "Allow",
+    [71] = "From",
+    [76] = "Origin",
+    [78] = "Authorization",
+    [91] = "Cache-Control",
+    [93] = "WWW-Authenticate",
+    [105] = "Accept-Encoding",
+    [108] = "If-None-Match",
+    [124] = "X-Forwarded-Host",
+    [135] = "Pragma",
+    [137] = "Accept-Ranges",
+    [139] = "Content-Type",
+    [140] = "Vary",
+    [152] = "Content-Range",
+    [155] = "Accept-Language",
+    [157] = "Content-Length",
+    [160] = "Referer",
+    [169] = "Range",
+    [170] = "Accept",
+    [174] = "Trailer",
+    [177] = "Transfer-Encoding",
+    [178] = "If-Match",
+    [181] = "Last-Modified",
+    [187] = "Access-Control-Request-Method",
+    [189] = "TE",
+    [193] = "If-Unmodified-Since",
+    [200] = "Age",
+    [201] = "Expires",
+    [205] = "Location",
+    [206] = "Accept-Charset",
+    [207] = "ETag",
+    [210] = "Proxy-Authorization",
+    [212] = "Server",
+    [228] = "Set-Cookie",
+    [229] = "Connection",
+    [236] = "X-Forwarded-Proto",
+    [239] = "Cookie",
+    [240] = "X-Request-ID",
+    [243] = "X-Requested-With",
+    [244] = "Content-Language",
+    [246] = "User-Agent",
+};
+
+static size_t well_known_header_lens[HEADER_NAME_SLOTS];
+
+/* registry reference to the table of interned well known header names, indexed by slot + 1 */
+static int header_names_ref = LUA_NOREF;
+
+#define ASCII_LOWER(c) ((((c) >= 'A')&&((c) <= 'Z')) ? ((c) | 0x20) : (c))
+
+/* returns slot of the well known header name matching name case insensitively, -1 otherwise */
+static int header_name_slot(const char* name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)ASCII_LOWER(name[i]);
+        h *= 16777619u;
+    }
+
+    int slot = (uint32_t)(h * HEADER_NAME_HASH_MULTIPLIER) >> 24;
+    const char* known = well_known_header_names[slot];
+    if ((known != NULL)&&(well_known_header_lens[slot] == len)&&(strncasecmp(known, name, len) == 0)) {
+        return slot;
+    }
+    return -1;
 }
 
-static int handle_name_value_pair(lua_State* L, const char* name, int name_len, bool hex_name, const char* value, int value_len, bool hex_value) {
-	if ((name != NULL)&&(name_len > 0)&&(value != NULL)&&(value_len > 0)) {
-		if (hex_name) {
-			name_len = decode_hex_str(name, name_len);
-		}
-		if (hex_value) {
-			value_len = decode_hex_str(value, value_len);
-		}
+static void push_header_name(lua_State* L, int slot) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, header_names_ref);
+    lua_rawgeti(L, -1, slot + 1);
+    lua_remove(L, -2);
+}
 
-		lua_getfield(L, 1, "storeHttpParam");
-		if (lua_isfunction(L, -1) != 1) {
-			raise_lua_error(L, "Missing lua function storeHttpParam()");
+static void init_header_names(lua_State* L) {
+    lua_createtable(L, HEADER_NAME_SLOTS, 0);
+    for (int slot = 0; slot < HEADER_NAME_SLOTS; slot++) {
+        const char* name = well_known_header_names[slot];
+        if (name != NULL) {
+            well_known_header_lens[slot] = strlen(name);
+            lua_pushstring(L, name);
+            lua_rawseti(L, -2, slot + 1);
         }
-		lua_pushvalue(L, 3);
-		lua_pushlstring(L, name, name_len);
-		lua_pushlstring(L, value, value_len) ;
-		lua_call(L, 3, 0);
-	}
-	else if((name_len == 0)&&(value_len > 0)) {
-	    error_to_lua(L, "400 Bad URL encoding: empty parameter name, non empty parameter value: %s ", value);
-	    return false;
-	}
-	return true; //param name without value is ok, e.g. &foo=
+    }
+    header_names_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+http_request_limits request_limits = {
+    .max_url_length = 8192,
+    .max_header_count = 100,
+    .max_header_bytes = 65536,
+    .max_body_size = 0
+};
+
+typedef struct {
+    int status;
+    const char* response;
+    size_t len;
+}
+limit_rejection;
+
+#define REJECTION(status, reason) \
+    {status, "HTTP/1.1 " #status " " reason "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", \
+        sizeof("HTTP/1.1 " #status " " reason "\r\nContent-Length: 0\r\nConnection: close\r\n\r\n") - 1}
+
+static const limit_rejection limit_rejections[] = {
+    REJECTION(413, "Request Entity Too Large"),
+    REJECTION(414, "Request-URI Too Long"),
+    REJECTION(431, "Request Header Fields Too Large"),
+};
+
+static size_t get_limit(lua_State *L, int config_idx, const char* name, size_t default_value) {
+    lua_getfield(L, config_idx, name);
+    size_t limit = lua_isnumber(L, -1) ? (size_t)lua_tointeger(L, -1) : default_value;
+    lua_pop(L, 1);
+    return limit;
+}
+
+/* reads request limits from luaw_server_config table at config_idx, keeping defaults for the ones
+ * not configured */
+void luaw_configure_http_limits(lua_State *L, int config_idx) {
+    request_limits.max_url_length = get_limit(L, config_idx, "max_url_length", request_limits.max_url_length);
+    request_limits.max_header_count = get_limit(L, config_idx, "max_header_count", request_limits.max_header_count);
+    request_limits.max_header_bytes = get_limit(L, config_idx, "max_header_bytes", request_limits.max_header_bytes);
+    request_limits.max_body_size = get_limit(L, config_idx, "max_body_size", request_limits.max_body_size);
+}
+
+#define OVER_LIMIT(count, limit) (((limit) > 0)&&((count) > (limit)))
+
+/* Adds len to the counter and records the status to reply with if it goes over the limit. Returns
+ * non zero, which aborts http_parser_execute(), when the limit is exceeded */
+static int count_towards_limit(luaw_http_parser_t* lhttp_parser, size_t* counter, size_t len, size_t limit, int status) {
+    *counter += len;
+    if ((lhttp_parser->parser.type == HTTP_REQUEST)&&(OVER_LIMIT(*counter, limit))) {
+        lhttp_parser->limit_status = status;
+        return 1;
+    }
+    return 0;
+}
+
+/* stores name and value on top of the stack in the table at table_idx, popping both. Repeated names
+ * are collected in a table of values in the order they were seen */
+static void add_name_value(lua_State* L, int table_idx) {
+    lua_pushvalue(L, -2);
+    lua_rawget(L, table_idx);
+    switch (lua_type(L, -1)) {
+        case LUA_TNIL:
+            lua_pop(L, 1);
+            lua_rawset(L, table_idx);
+            break;
+
+        case LUA_TTABLE:
+            /* multi-valued name */
+            lua_insert(L, -2);
+            lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+            lua_pop(L, 2);
+            break;
+
+        default:
+            /* single string value already stored against the same name, convert it to table */
+            lua_createtable(L, 2, 0);
+            lua_insert(L, -2);
+            lua_rawseti(L, -2, 1);
+            lua_insert(L, -2);
+            lua_rawseti(L, -2, 2);
+            lua_rawset(L, table_idx);
+    }
+}
+
+/* value of every hex digit indexed by its character, -1 for characters that are not hex digits */
+static const int8_t hex_values[256] = {
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+     0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+    -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+    -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+};
+
+/* decodes next character of URL encoded string, returns number of encoded chars consumed */
+static int next_url_decoded_char(const char* str, size_t len, char* ch) {
+    if ((*str == '%')&&(len > 2)) {
+        int hi = hex_values[(uint8_t)str[1]];
+        int lo = hex_values[(uint8_t)str[2]];
+        if ((hi >= 0)&&(lo >= 0)) {
+            *ch = (char)((hi << 4) | lo);
+            return 3;
+        }
+    }
+    *ch = (*str == '+') ? ' ' : *str;
+    return 1;
+}
+
+static bool url_decoded_equals(const char* str, size_t len, const char* name, size_t name_len) {
+    size_t i = 0;
+    char ch;
+    while (len > 0) {
+        int consumed = next_url_decoded_char(str, len, &ch);
+        if ((i >= name_len)||(name[i] != ch)) return false;
+        i++;
+        str += consumed;
+        len -= consumed;
+    }
+    return (i == name_len);
+}
+
+static void push_url_decoded(lua_State* L, const char* str, size_t len) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    char ch;
+    while (len > 0) {
+        int consumed = next_url_decoded_char(str, len, &ch);
+        luaL_addchar(&b, ch);
+        str += consumed;
+        len -= consumed;
+    }
+    luaL_pushresult(&b);
+}
+
+/* Lua call spec:
+ value = http_lib.urlDecodeParam(url encoded string, name)
+ Decodes value of a single parameter without touching the others. Multi-valued parameters are
+ returned as table, nothing is returned if the parameter is not present.
+*/
+LUA_LIB_METHOD static int luaw_url_decode_param(lua_State *L) {
+    size_t len = 0, name_len = 0;
+    const char* str = luaL_checklstring(L, 1, &len);
+    const char* name = luaL_checklstring(L, 2, &name_len);
+    const char* end = str + len;
+    int found = 0;
+
+    while (str < end) {
+        const char* amp = memchr(str, '&', end - str);
+        if (amp == NULL) amp = end;
+        const char* eq = memchr(str, '=', amp - str);
+
+        if ((eq != NULL)&&(eq > str)&&((amp - eq) > 1)&&(url_decoded_equals(str, eq - str, name, name_len))) {
+            push_url_decoded(L, eq + 1, amp - eq - 1);
+            found++;
+            if (found == 2) {
+                lua_createtable(L, 2, 0);
+                lua_insert(L, -3);
+                lua_rawseti(L, -3, 2);
+                lua_rawseti(L, -2, 1);
+            } else if (found > 2) {
+                lua_rawseti(L, -2, found);
+            }
+        }
+        str = amp + 1;
+    }
+    return (found > 0) ? 1 : 0;
+}
+
+static void push_url_component(lua_State* L, const char* str, size_t len) {
+    if ((memchr(str, '%', len) != NULL)||(memchr(str, '+', len) != NULL)) {
+        push_url_decoded(L, str, len);
+    } else {
+        lua_pushlstring(L, str, len);
+    }
+}
+
+static const char* url_encoding_errors[] = {
+    [starting_name] = "400 Bad URL encoding: Error while expecting start of param name at: ",
+    [in_name] = "400 Bad URL encoding: Error while parsing param name at: ",
+    [starting_value] = "400 Bad URL encoding: Error while expecting start of param value at: ",
+    [in_value] = "400 Bad URL encoding: Error while parsing param value at: "
+};
+
+/* Checks url encoded string against name=value&name=value... grammar. Returns NULL if the string
+ * is well formed, otherwise returns position of the offending char with *state set to the decoder
+ * state it was found in. Params without value (e.g. &foo= or &foo) are accepted.
+ */
+static const char* find_url_encoding_error(const char* read_ptr, size_t length, decoder_state* state) {
+    const char* end = read_ptr + length;
+    decoder_state ds = starting_name;
+
+    for (; read_ptr < end; read_ptr++) {
+        char ch = *read_ptr;
+
+        switch(ds) {
+            case starting_name:
+                if ((ch == '&')||(ch == '=')) goto malformed;
+                ds = in_name;
+                break;
+
+            case in_name:
+                if (ch == '&') goto malformed;
+                if (ch == '=') ds = starting_value;
+                break;
+
+            case starting_value:
+                if ((ch == '&')||(ch == '=')) goto malformed;
+                ds = in_value;
+                break;
+
+            case in_value:
+                if (ch == '=') goto malformed;
+                if (ch == '&') ds = starting_name;
+                break;
+        }
+    }
+    return NULL;
+
+malformed:
+    *state = ds;
+    return read_ptr;
 }
 
 /* Lua call spec:
@@ -97,84 +397,64 @@ LUA_LIB_METHOD static int luaw_url_decode(lua_State *L) {
 	if (!lua_istable(L, 1)) {
 		return raise_lua_error(L, "Luaw HTTP lib table is missing");
 	}
-	size_t length = 0;
-	const char* data = lua_tolstring(L, 2, &length);
-	char *read_ptr = (char *)data;
-	char *name = NULL;
-	char *value = NULL;
-	bool hex_name = false, hex_value = false;
-	int name_len = 0, value_len = 0;
-	decoder_state ds = starting_name;
-
-	while (length--) {
-		char ch = *read_ptr;
-
-		switch(ds) {
-			case starting_name:
-                if (!handle_name_value_pair(L, name, name_len, hex_name, value, value_len, hex_value)) return 2; //err_code, err_mesg
-				name_len = 0;
-				hex_name = false;
-				value_len = 0;
-				hex_value = false;
-
-				switch(ch) {
-					case '&':
-					case '=':
-                	    return error_to_lua(L, "400 Bad URL encoding: Error while expecting start of param name at: %s\n", read_ptr);
-					case '%':
-						hex_name = true;
-				}
-				ds = in_name;
-				name = read_ptr;
-				name_len = 1;
-				break;
-
-			case in_name:
-				switch(ch) {
-					case '&':
-			    	    return error_to_lua(L, "400 Bad URL encoding: Error while parsing param name at: %s\n", read_ptr);
-					case '=':
-						ds = starting_value;
-						break;
-					case '%':
-						hex_name = true;
-					default:
-						name_len++;
-				}
-				break;
-
-			case starting_value:
-				switch(ch) {
-					case '&':
-					case '=':
-			    	    return error_to_lua(L, "400 Bad URL encoding: Error while expecting start of param value at: %s\n", read_ptr);
-					case '%':
-						hex_value = true;
-				}
-				ds = in_value;
-				value = read_ptr;
-				value_len = 1;
-				break;
-
-			case in_value:
-				switch(ch) {
-					case '&':
-						ds = starting_name;
-						break;
-					case '=':
-			    	    return error_to_lua(L, "400 Bad URL encoding: Error while parsing param value at: %s\n", read_ptr);
-					case '%':
-						hex_value = true;
-					default:
-						value_len++;
-				}
-				break;
-
-		}
-		if (ch == '+') *read_ptr =' ';
-		read_ptr++;
-	}
-    return handle_name_value_pair(L, name, name_len, hex_name, value, value_len, hex_value) ? 1 : 2;
+    size_t length = 0;
+    const char* data = luaL_checklstring(L, 2, &length);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_settop(L, 3);
+
+    decoder_state ds;
+    const char* error_at = find_url_encoding_error(data, length, &ds);
+    if (error_at != NULL) {
+        return error_to_lua(L, "%s%s\n", url_encoding_errors[ds], error_at);
+    }
+
+    /* grammar is checked, every & separated pair has a non empty name */
+    const char* end = data + length;
+    while (data < end) {
+        const char* amp = memchr(data, '&', end - data);
+        if (amp == NULL) amp = end;
+        const char* eq = memchr(data, '=', amp - data);
+
+        if ((eq != NULL)&&((amp - eq) > 1)) {
+            push_url_component(L, data, eq - data);
+            push_url_component(L, eq + 1, amp - eq - 1);
+            add_name_value(L, 3);
+        }
+        data = amp + 1;
+    }
+    return 1;
+}
+
+/* Lua call spec:
+ valid: true = http_lib.checkUrlEncoding(url encoded string)
+ malformed: false, error message = http_lib.checkUrlEncoding(url encoded string)
+ Runs the same checks as urlDecode() without decoding anything, so that a malformed query string
+ can be rejected up front while its params are decoded lazily.
+*/
+LUA_LIB_METHOD static int luaw_check_url_encoding(lua_State *L) {
+    size_t length = 0;
+    const char* data = luaL_checklstring(L, 1, &length);
+
+    decoder_state ds;
+    const char* error_at = find_url_encoding_error(data, length, &ds);
+    if (error_at != NULL) {
+        return error_to_lua(L, "%s%s\n", url_encoding_errors[ds], error_at);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static void reset_batch_state(luaw_http_parser_t* lhttp_parser) {
+    lhttp_parser->last_cb = http_cb_none;
+    lhttp_parser->lazy_active = false;
+    lhttp_parser->header_count = 0;
+    lhttp_parser->url_bytes = 0;
+    lhttp_parser->header_bytes = 0;
+    lhttp_parser->headers_seen = 0;
+    lhttp_parser->body_bytes = 0;
+    lhttp_parser->limit_status = 0;
+    memset(&lhttp_parser->header_name, 0, sizeof(http_field_fragment));
+    memset(&lhttp_parser->header_value, 0, sizeof(http_field_fragment));
 }
 
 static int new_lhttp_parser(lua_State *L, enum http_parser_type parser_type) {
@@ -185,6 +465,9 @@ static int new_lhttp_parser(lua_State *L, enum http_parser_type parser_type) {
 	luaL_setmetatable(L, LUA_HTTP_PARSER_META_TABLE);
 	http_parser_init(&lhttp_parser->parser, parser_type);
 	lhttp_parser->parser.data = lhttp_parser;
+	lhttp_parser->L = NULL;
+	lhttp_parser->buff = NULL;
+	reset_batch_state(lhttp_parser);
 	return 1;
 }
 
@@ -200,6 +483,7 @@ LUA_LIB_METHOD static int luaw_init_http_parser(lua_State* L) {
 	luaw_http_parser_t* lhttp_parser = luaL_checkudata(L, 1, LUA_HTTP_PARSER_META_TABLE);
 	http_parser* parser = &lhttp_parser->parser;
 	http_parser_init(parser, parser->type);
+	reset_batch_state(lhttp_parser);
     return 0;
 }
 
@@ -255,6 +539,264 @@ static const http_parser_settings parser_settings = {
 	.on_message_complete = http_parser_on_message_complete
 };
 
+/* Batch mode: URL, status and headers are stored directly into the request table passed to
+ * parseHttpBatch() and parser is paused only on headers complete, body and message complete
+ * callbacks that need to be handled in Lua. */
+
+static void raw_get_req_field(lua_State* L, const char* field) {
+    lua_pushstring(L, field);
+    lua_rawget(L, PARSE_HTTP_REQ_IDX);
+}
+
+static void raw_set_req_field(lua_State* L, const char* field) {
+    lua_pushstring(L, field);
+    lua_insert(L, -2);
+    lua_rawset(L, PARSE_HTTP_REQ_IDX);
+}
+
+/* pushes full value of the field onto the stack and resets the fragment */
+static void push_fragment(lua_State* L, http_field_fragment* frag, const char* field) {
+    if (frag->spilled) {
+        raw_get_req_field(L, field);
+        if (frag->start != NULL) {
+            lua_pushlstring(L, frag->start, frag->len);
+            lua_concat(L, 2);
+        }
+        lua_pushnil(L);
+        raw_set_req_field(L, field);
+    } else if (frag->start != NULL) {
+        lua_pushlstring(L, frag->start, frag->len);
+    } else {
+        lua_pushliteral(L, "");
+    }
+    frag->start = NULL;
+    frag->spilled = false;
+}
+
+/* saves fragment pointing into current buffer in the hidden request field */
+static void spill_fragment(lua_State* L, http_field_fragment* frag, const char* field) {
+    if (frag->start != NULL) {
+        push_fragment(L, frag, field);
+        raw_set_req_field(L, field);
+        frag->spilled = true;
+    }
+}
+
+static void append_fragment(lua_State* L, http_field_fragment* frag, const char* field, const char* start, size_t len) {
+    spill_fragment(L, frag, field);
+    frag->start = start;
+    frag->len = len;
+}
+
+/* pushes request's headers table, creating one if missing. Returns its stack index */
+static int push_req_headers(lua_State* L) {
+    raw_get_req_field(L, "headers");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        raw_set_req_field(L, "headers");
+    }
+    return lua_gettop(L);
+}
+
+/* pushes header name, using pre-interned canonical name for well known headers */
+static void push_header_name_str(lua_State* L, const char* name, size_t len, int slot) {
+    if (slot >= 0) {
+        push_header_name(L, slot);
+    } else {
+        lua_pushlstring(L, name, len);
+    }
+}
+
+/* decodes all the headers recorded as offsets so far into the request's headers table and stops
+ * lazy recording for the current message */
+static void flush_lazy_headers(luaw_http_parser_t* lhttp_parser) {
+    lua_State* L = lhttp_parser->L;
+    const char* base = lhttp_parser->lazy_base;
+    lhttp_parser->lazy_active = false;
+
+    if (lhttp_parser->header_count > 0) {
+        int headers_idx = push_req_headers(L);
+        for (int i = 0; i < lhttp_parser->header_count; i++) {
+            http_header_offsets* h = &lhttp_parser->headers[i];
+            push_header_name_str(L, base + h->name_off, h->name_len, h->slot);
+            lua_pushlstring(L, base + h->value_off, h->value_len);
+            add_name_value(L, headers_idx);
+        }
+        lua_pop(L, 1);
+        lhttp_parser->header_count = 0;
+    }
+}
+
+static bool record_lazy_header(luaw_http_parser_t* lhttp_parser) {
+    http_field_fragment* name = &lhttp_parser->header_name;
+    http_field_fragment* value = &lhttp_parser->header_value;
+
+    if ((name->spilled)||(value->spilled)||(lhttp_parser->header_count >= MAX_LAZY_HEADERS)) {
+        return false;
+    }
+
+    const char* base = lhttp_parser->lazy_base;
+    http_header_offsets* h = &lhttp_parser->headers[lhttp_parser->header_count++];
+    h->name_off = name->start - base;
+    h->name_len = name->len;
+    h->slot = header_name_slot(name->start, name->len);
+    if (value->start != NULL) {
+        h->value_off = value->start - base;
+        h->value_len = value->len;
+    } else {
+        h->value_off = 0;
+        h->value_len = 0;
+    }
+
+    name->start = NULL;
+    value->start = NULL;
+    return true;
+}
+
+static void store_header(luaw_http_parser_t* lhttp_parser) {
+    lua_State* L = lhttp_parser->L;
+    http_field_fragment* name = &lhttp_parser->header_name;
+    http_field_fragment* value = &lhttp_parser->header_value;
+
+    if ((name->start == NULL)&&(!name->spilled)) return;
+
+    if (lhttp_parser->lazy_active) {
+        if (record_lazy_header(lhttp_parser)) return;
+        flush_lazy_headers(lhttp_parser);
+    }
+
+    int headers_idx = push_req_headers(L);
+
+    /* store well known headers under their canonical names, using pre-interned strings */
+    int slot = -1;
+    if (!name->spilled) {
+        slot = header_name_slot(name->start, name->len);
+    }
+    if (slot >= 0) {
+        push_header_name(L, slot);
+        name->start = NULL;
+    } else {
+        push_fragment(L, name, ACC_HEADER_NAME);
+        size_t len;
+        const char* str = lua_tolstring(L, -1, &len);
+        slot = header_name_slot(str, len);
+        if (slot >= 0) {
+            lua_pop(L, 1);
+            push_header_name(L, slot);
+        }
+    }
+    push_fragment(L, value, ACC_HEADER_VALUE);
+
+    add_name_value(L, headers_idx);
+    lua_pop(L, 1);
+}
+
+static void store_chunked_value(luaw_http_parser_t* lhttp_parser, http_parser_cb_type cb, const char* field, const char* start, size_t len) {
+    lua_State* L = lhttp_parser->L;
+    if (lhttp_parser->last_cb == cb) {
+        /* continuation of the value from the previous buffer */
+        raw_get_req_field(L, field);
+        lua_pushlstring(L, start, len);
+        lua_concat(L, 2);
+    } else {
+        lua_pushlstring(L, start, len);
+    }
+    raw_set_req_field(L, field);
+    lhttp_parser->last_cb = cb;
+}
+
+HTTP_PARSER_CALLBACK static int batch_on_message_begin(http_parser *parser) {
+    luaw_http_parser_t* lhttp_parser = (luaw_http_parser_t*) parser->data;
+    lua_State* L = lhttp_parser->L;
+
+    lua_getfield(L, PARSE_HTTP_REQ_IDX, "reset");
+    if (lua_isfunction(L, -1)) {
+        lua_pushvalue(L, PARSE_HTTP_REQ_IDX);
+        lua_call(L, 1, 0);
+    } else {
+        lua_pop(L, 1);
+    }
+    reset_batch_state(lhttp_parser);
+    lhttp_parser->last_cb = http_cb_on_message_begin;
+    lhttp_parser->lazy_active = lhttp_parser->lazy_requested;
+    lhttp_parser->lazy_base = lhttp_parser->buff;
+    return 0;
+}
+
+HTTP_PARSER_CALLBACK static int batch_on_url(http_parser *parser, const char* start, size_t len) {
+    luaw_http_parser_t* lhttp_parser = (luaw_http_parser_t*) parser->data;
+    if (count_towards_limit(lhttp_parser, &lhttp_parser->url_bytes, len, request_limits.max_url_length, 414)) return 1;
+    store_chunked_value(lhttp_parser, http_cb_on_url, "url", start, len);
+    return 0;
+}
+
+HTTP_PARSER_CALLBACK static int batch_on_status(http_parser *parser, const char* start, size_t len) {
+    store_chunked_value((luaw_http_parser_t*) parser->data, http_cb_on_status, "statusMesg", start, len);
+    return 0;
+}
+
+HTTP_PARSER_CALLBACK static int batch_on_header_name(http_parser *parser, const char* start, size_t len) {
+    luaw_http_parser_t* lhttp_parser = (luaw_http_parser_t*) parser->data;
+    if (count_towards_limit(lhttp_parser, &lhttp_parser->header_bytes, len, request_limits.max_header_bytes, 431)) return 1;
+    if (lhttp_parser->last_cb != http_cb_on_header_field) {
+        if (count_towards_limit(lhttp_parser, &lhttp_parser->headers_seen, 1, request_limits.max_header_count, 431)) return 1;
+        store_header(lhttp_parser);
+    }
+    append_fragment(lhttp_parser->L, &lhttp_parser->header_name, ACC_HEADER_NAME, start, len);
+    lhttp_parser->last_cb = http_cb_on_header_field;
+    return 0;
+}
+
+HTTP_PARSER_CALLBACK static int batch_on_header_value(http_parser *parser, const char* start, size_t len) {
+    luaw_http_parser_t* lhttp_parser = (luaw_http_parser_t*) parser->data;
+    if (count_towards_limit(lhttp_parser, &lhttp_parser->header_bytes, len, request_limits.max_header_bytes, 431)) return 1;
+    append_fragment(lhttp_parser->L, &lhttp_parser->header_value, ACC_HEADER_VALUE, start, len);
+    lhttp_parser->last_cb = http_cb_on_header_value;
+    return 0;
+}
+
+HTTP_PARSER_CALLBACK static int batch_on_headers_complete(http_parser *parser) {
+    luaw_http_parser_t* lhttp_parser = (luaw_http_parser_t*) parser->data;
+    /* reject declared body that is too big before reading any of it */
+    if ((parser->type == HTTP_REQUEST)&&(!(parser->flags & F_CHUNKED))&&(parser->content_length != ULLONG_MAX)
+        &&(OVER_LIMIT(parser->content_length, request_limits.max_body_size)))
+    {
+        lhttp_parser->limit_status = 413;
+        return 1;
+    }
+    store_header(lhttp_parser);
+    lhttp_parser->last_cb = http_cb_on_headers_complete;
+    return handle_http_callback(parser, http_cb_on_headers_complete, NULL, 0);
+}
+
+HTTP_PARSER_CALLBACK static int batch_on_body(http_parser *parser, const char* start, size_t len) {
+    luaw_http_parser_t* lhttp_parser = (luaw_http_parser_t*) parser->data;
+    if (count_towards_limit(lhttp_parser, &lhttp_parser->body_bytes, len, request_limits.max_body_size, 413)) return 1;
+    lhttp_parser->last_cb = http_cb_on_body;
+    return handle_http_callback(parser, http_cb_on_body, start, len);
+}
+
+HTTP_PARSER_CALLBACK static int batch_on_message_complete(http_parser *parser) {
+    luaw_http_parser_t* lhttp_parser = (luaw_http_parser_t*) parser->data;
+    /* trailing headers of chunked body */
+    store_header(lhttp_parser);
+    lhttp_parser->last_cb = http_cb_on_mesg_complete;
+    return handle_http_callback(parser, http_cb_on_mesg_complete, NULL, 0);
+}
+
+static const http_parser_settings batch_parser_settings = {
+	.on_message_begin = batch_on_message_begin,
+	.on_status = batch_on_status,
+	.on_url = batch_on_url,
+	.on_header_field = batch_on_header_name,
+	.on_header_value = batch_on_header_value,
+	.on_headers_complete = batch_on_headers_complete,
+	.on_body = batch_on_body,
+	.on_message_complete = batch_on_message_complete
+};
+
 /* Lua call spec:
 * All failures:
 *       false, error message = parser:parseHttp(str, offset)
@@ -271,10 +813,7 @@ static const http_parser_settings parser_settings = {
 *       http_cb_type, new offset, parsed value = parser:parseHttp(conn, str, offset)
 *
 */
-static int parse_http(lua_State *L) {
-    lua_settop(L, 3);
-
-	luaw_http_parser_t* lhttp_parser = luaL_checkudata(L, 1, LUA_HTTP_PARSER_META_TABLE);
+static int parse_http_internal(lua_State *L, luaw_http_parser_t* lhttp_parser, const http_parser_settings* settings) {
 	http_parser* parser = &lhttp_parser->parser;
 
     size_t len = 0;
@@ -290,7 +829,7 @@ static int parse_http(lua_State *L) {
 	/* every http_parser_execute() does not necessarily cause callback to be invoked, we need to know if it
 	   did call the callback */
 	lhttp_parser->http_cb = http_cb_none;
-	const int nparsed = http_parser_execute(parser, &parser_settings, (buff+offset), (len-offset));
+	const int nparsed = http_parser_execute(parser, settings, (buff+offset), (len-offset));
 	offset += nparsed;
 	const int remaining = len - offset;
 
@@ -336,6 +875,270 @@ static int parse_http(lua_State *L) {
     return nresults;
 }
 
+static int parse_http(lua_State *L) {
+    lua_settop(L, 3);
+	luaw_http_parser_t* lhttp_parser = luaL_checkudata(L, 1, LUA_HTTP_PARSER_META_TABLE);
+    return parse_http_internal(L, lhttp_parser, &parser_settings);
+}
+
+static void push_header_index(lua_State* L, luaw_http_parser_t* lhttp_parser) {
+    int count = lhttp_parser->header_count;
+    luaw_header_index_t* index = lua_newuserdata(L, sizeof(luaw_header_index_t) + (count * sizeof(http_header_offsets)));
+    luaL_setmetatable(L, LUA_HTTP_HEADER_INDEX_META_TABLE);
+    index->count = count;
+    memcpy(index->headers, lhttp_parser->headers, count * sizeof(http_header_offsets));
+
+    /* keep raw buffer alive for as long as the index is around */
+    lua_createtable(L, 1, 0);
+    lua_pushvalue(L, PARSE_HTTP_BUFF_IDX);
+    lua_rawseti(L, -2, 1);
+    lua_setuservalue(L, -2);
+
+    lhttp_parser->lazy_active = false;
+    lhttp_parser->header_count = 0;
+}
+
+/* fast path copies offsets of all its headers into the lazy header index */
+_Static_assert(FAST_HTTP_MAX_HEADERS <= MAX_LAZY_HEADERS, "FAST_HTTP_MAX_HEADERS must not exceed MAX_LAZY_HEADERS");
+
+/* Tries to parse a complete bodiless request at the start of a new message using the fast path
+ * scanner. Returns number of results pushed, same as the state machine would after headers
+ * complete plus a flag telling caller that the message is already complete too, or 0 if the
+ * request has to go through the state machine. */
+static int parse_http_fast(lua_State *L, luaw_http_parser_t* lhttp_parser) {
+    size_t len = 0;
+    const char* buff = lua_tolstring(L, PARSE_HTTP_BUFF_IDX, &len);
+    size_t offset = lua_tointeger(L, PARSE_HTTP_OFFSET_IDX);
+    if (offset >= len) return 0;
+
+    fast_http_request_t req;
+    size_t consumed = fast_parse_http_request(buff + offset, len - offset, &req);
+    if (consumed == 0) return 0;
+
+    /* leave requests over the limits to the state machine which rejects them */
+    size_t header_bytes = 0;
+    for (size_t i = 0; i < req.num_headers; i++) {
+        header_bytes += req.headers[i].name_len + req.headers[i].value_len;
+    }
+    if ((OVER_LIMIT(req.url_len, request_limits.max_url_length))||(OVER_LIMIT(req.num_headers, request_limits.max_header_count))
+        ||(OVER_LIMIT(header_bytes, request_limits.max_header_bytes)))
+    {
+        return 0;
+    }
+
+    batch_on_message_begin(&lhttp_parser->parser);
+
+    lua_pushlstring(L, req.url, req.url_len);
+    raw_set_req_field(L, "url");
+
+    bool lazy = lhttp_parser->lazy_active;
+    if (lazy) {
+        for (size_t i = 0; i < req.num_headers; i++) {
+            fast_http_header_t* fh = &req.headers[i];
+            http_header_offsets* h = &lhttp_parser->headers[i];
+            h->name_off = fh->name - buff;
+            h->name_len = fh->name_len;
+            h->value_off = fh->value - buff;
+            h->value_len = fh->value_len;
+            h->slot = header_name_slot(fh->name, fh->name_len);
+        }
+        lhttp_parser->header_count = req.num_headers;
+    } else {
+        int headers_idx = push_req_headers(L);
+        for (size_t i = 0; i < req.num_headers; i++) {
+            fast_http_header_t* fh = &req.headers[i];
+            push_header_name_str(L, fh->name, fh->name_len, header_name_slot(fh->name, fh->name_len));
+            lua_pushlstring(L, fh->value, fh->value_len);
+            add_name_value(L, headers_idx);
+        }
+        lua_pop(L, 1);
+    }
+    lhttp_parser->last_cb = http_cb_on_mesg_complete;
+
+    lua_pushinteger(L, http_cb_on_headers_complete);
+    lua_pushinteger(L, offset + consumed);
+    lua_pushboolean(L, req.keep_alive);
+    lua_pushinteger(L, 1);
+    lua_pushinteger(L, req.http_minor);
+    lua_pushstring(L, req.method);
+    lua_pushnil(L);
+    if (lazy) {
+        push_header_index(L, lhttp_parser);
+    } else {
+        lua_pushnil(L);
+    }
+    lua_pushboolean(L, 1);
+    return 9;
+}
+
+/* Replies to the client with the canned response for the limit exceeded, closes the connection and
+ * returns error to Lua. Nothing that was parsed so far is of any use to Lua. Pipelined request
+ * (req.luaw_pipelined) can't be answered directly as the responses to the requests before it may
+ * still be pending, so only its req.luaw_reject_status is set for Lua to answer through the
+ * connection's response queue */
+static int reject_request(lua_State *L, int status) {
+    raw_get_req_field(L, "luaw_pipelined");
+    bool pipelined = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (pipelined) {
+        lua_pushinteger(L, status);
+        raw_set_req_field(L, "luaw_reject_status");
+        return error_to_lua(L, "%d Request exceeds configured limits", status);
+    }
+
+    const limit_rejection* rejection = &limit_rejections[0];
+    for (size_t i = 0; i < sizeof(limit_rejections)/sizeof(limit_rejection); i++) {
+        if (limit_rejections[i].status == status) rejection = &limit_rejections[i];
+    }
+
+    raw_get_req_field(L, "luaw_conn");
+    reject_connection(to_connection(L, -1), rejection->response, rejection->len);
+    return error_to_lua(L, "%d Request exceeds configured limits", status);
+}
+
+/* Lua call spec:
+*   Same as parser:parseHttp() except that URL, status message and headers are stored directly in
+*   req and the call returns only on headers complete, body, message complete or when the whole
+*   string is consumed:
+*
+*       http_cb_type, new offset, ... = parser:parseHttpBatch(str, offset, req, lazyHeaders)
+*
+*   If lazyHeaders is true and all the headers are contained in a single string, headers are not
+*   stored in req. Instead, index of their offsets in the string is returned as an additional
+*   result of the headers complete callback, to be decoded on demand.
+*
+*   Requests exceeding configured URL, header or body size limits are answered with 414, 431 or 413
+*   right here and the connection is closed before returning the error.
+*
+*   Well formed bodiless requests are parsed by the SIMD fast path in one go. In that case headers
+*   complete results are followed by true, meaning that the message is complete as well.
+*/
+static int parse_http_batch(lua_State *L) {
+    lua_settop(L, 5);
+	luaw_http_parser_t* lhttp_parser = luaL_checkudata(L, 1, LUA_HTTP_PARSER_META_TABLE);
+    luaL_checktype(L, PARSE_HTTP_REQ_IDX, LUA_TTABLE);
+
+    lhttp_parser->L = L;
+    lhttp_parser->buff = lua_tostring(L, PARSE_HTTP_BUFF_IDX);
+    lhttp_parser->lazy_requested = lua_toboolean(L, 5);
+
+    if ((lhttp_parser->parser.type == HTTP_REQUEST)&&(lhttp_parser->last_cb == http_cb_none)) {
+        /* start of a new request */
+        int nresults = parse_http_fast(L, lhttp_parser);
+        if (nresults) {
+            lhttp_parser->L = NULL;
+            lhttp_parser->buff = NULL;
+            return nresults;
+        }
+    }
+
+    int nresults = parse_http_internal(L, lhttp_parser, &batch_parser_settings);
+    if (lhttp_parser->limit_status) {
+        lhttp_parser->L = NULL;
+        lhttp_parser->buff = NULL;
+        return reject_request(L, lhttp_parser->limit_status);
+    }
+
+    int top = lua_gettop(L);
+    if ((lhttp_parser->lazy_active)&&(lhttp_parser->http_cb == http_cb_on_headers_complete)&&(nresults == 7)) {
+        push_header_index(L, lhttp_parser);
+        top++;
+        nresults++;
+    } else if (lhttp_parser->lazy_active) {
+        /* headers continue in the next buffer, offsets into this one will be meaningless */
+        flush_lazy_headers(lhttp_parser);
+    }
+
+    /* buffer may end in the middle of a header, save what we have got so far in the request */
+    spill_fragment(L, &lhttp_parser->header_name, ACC_HEADER_NAME);
+    spill_fragment(L, &lhttp_parser->header_value, ACC_HEADER_VALUE);
+    lua_settop(L, top);
+    lhttp_parser->L = NULL;
+    lhttp_parser->buff = NULL;
+
+    return nresults;
+}
+
+static const char* get_index_buffer(lua_State* L, int index_idx) {
+    lua_getuservalue(L, index_idx);
+    lua_rawgeti(L, -1, 1);
+    return lua_tostring(L, -1);
+}
+
+/* Lua call spec: value, stored name = header_index:get(name)
+* Decodes value of the given header, matching name case insensitively. Multiple headers with the
+* same name are returned as a table. Returns nothing if there is no such header.
+*/
+LUA_OBJ_METHOD static int header_index_get(lua_State* L) {
+    luaw_header_index_t* index = luaL_checkudata(L, 1, LUA_HTTP_HEADER_INDEX_META_TABLE);
+    size_t name_len = 0;
+    const char* name = luaL_checklstring(L, 2, &name_len);
+    const char* base = get_index_buffer(L, 1);
+
+    int slot = header_name_slot(name, name_len);
+    int found = 0;
+    http_header_offsets* first = NULL;
+
+    for (int i = 0; i < index->count; i++) {
+        http_header_offsets* h = &index->headers[i];
+        bool match = (slot >= 0) ? (h->slot == slot) :
+            ((h->slot < 0)&&(h->name_len == name_len)&&(strncasecmp(base + h->name_off, name, name_len) == 0));
+        if (!match) continue;
+
+        lua_pushlstring(L, base + h->value_off, h->value_len);
+        found++;
+        if (found == 1) {
+            first = h;
+        } else if (found == 2) {
+            lua_createtable(L, 2, 0);
+            lua_insert(L, -3);
+            lua_rawseti(L, -3, 2);
+            lua_rawseti(L, -2, 1);
+        } else {
+            lua_rawseti(L, -2, found);
+        }
+    }
+
+    if (!found) return 0;
+    push_header_name_str(L, base + first->name_off, first->name_len, first->slot);
+    return 2;
+}
+
+/* Lua call spec: header_index:materialize(headers)
+* Decodes all headers into given headers table, skipping names already present in it.
+*/
+LUA_OBJ_METHOD static int header_index_materialize(lua_State* L) {
+    luaw_header_index_t* index = luaL_checkudata(L, 1, LUA_HTTP_HEADER_INDEX_META_TABLE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    const char* base = get_index_buffer(L, 1);
+
+    lua_newtable(L);
+    int decoded_idx = lua_gettop(L);
+    for (int i = 0; i < index->count; i++) {
+        http_header_offsets* h = &index->headers[i];
+        push_header_name_str(L, base + h->name_off, h->name_len, h->slot);
+        lua_pushlstring(L, base + h->value_off, h->value_len);
+        add_name_value(L, decoded_idx);
+    }
+
+    /* headers already decoded on access may have been modified since, keep them as is */
+    lua_pushnil(L);
+    while (lua_next(L, decoded_idx) != 0) {
+        lua_pushvalue(L, -2);
+        lua_rawget(L, 2);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -2);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, 2);
+            lua_pop(L, 1);
+        } else {
+            lua_pop(L, 2);
+        }
+    }
+    return 0;
+}
+
 
 const char* url_field_names[] = { "schema", "host", "port", "path", "queryString", "fragment", "userInfo" };
 
@@ -379,22 +1182,561 @@ LUA_LIB_METHOD static int luaw_parse_url(lua_State *L) {
 	return 1;
 }
 
+/* Lua call spec: canonical name = http_lib.canonicalHeaderName(name)
+* Returns canonical spelling of a well known header name, name as is for all other names.
+*/
+LUA_LIB_METHOD static int luaw_canonical_header_name(lua_State *L) {
+    size_t len = 0;
+    const char* name = luaL_checklstring(L, 1, &len);
+    int slot = header_name_slot(name, len);
+    if (slot >= 0) {
+        push_header_name(L, slot);
+    } else {
+        lua_settop(L, 1);
+    }
+    return 1;
+}
+
+/* Lua call spec: value = http_lib.getHeader(headers, name)
+* Case insensitive header lookup, used as __index metamethod of headers tables. Well known headers
+* are always stored under their canonical name so they are looked up directly. Other headers are
+* looked up by scanning the headers table.
+*/
+LUA_LIB_METHOD static int luaw_get_header(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    if (lua_type(L, 2) != LUA_TSTRING) {
+        return 0;
+    }
+
+    size_t len = 0;
+    const char* name = lua_tolstring(L, 2, &len);
+    int slot = header_name_slot(name, len);
+    if (slot >= 0) {
+        push_header_name(L, slot);
+        lua_rawget(L, 1);
+        return 1;
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        if (lua_type(L, -2) == LUA_TSTRING) {
+            size_t key_len = 0;
+            const char* key = lua_tolstring(L, -2, &key_len);
+            if ((key_len == len)&&(strncasecmp(key, name, len) == 0)) {
+                return 1;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+/* Cookie header parsing as per RFC 6265: name=value pairs separated by ';', optionally
+* followed by a space. Pairs without '=' are skipped and values may be enclosed in double quotes.
+*/
+typedef struct {
+    const char* name;
+    size_t name_len;
+    const char* value;
+    size_t value_len;
+} cookie_pair;
+
+static bool is_cookie_space(char c) {
+    return ((c == ' ')||(c == '\t'));
+}
+
+/* parses next cookie pair starting at s, returns position following it, NULL when there are no more pairs */
+static const char* next_cookie(const char* s, const char* end, cookie_pair* cookie) {
+    while (s < end) {
+        while ((s < end)&&((is_cookie_space(*s))||(*s == ';'))) s++;
+        if (s == end) break;
+
+        const char* pair_end = memchr(s, ';', end - s);
+        if (pair_end == NULL) pair_end = end;
+
+        const char* eq = memchr(s, '=', pair_end - s);
+        if (eq != NULL) {
+            const char* name_end = eq;
+            while ((name_end > s)&&(is_cookie_space(name_end[-1]))) name_end--;
+
+            const char* value = eq + 1;
+            const char* value_end = pair_end;
+            while ((value < value_end)&&(is_cookie_space(*value))) value++;
+            while ((value_end > value)&&(is_cookie_space(value_end[-1]))) value_end--;
+            if ((value_end - value >= 2)&&(*value == '"')&&(value_end[-1] == '"')) {
+                value++;
+                value_end--;
+            }
+
+            if (name_end > s) {
+                cookie->name = s;
+                cookie->name_len = name_end - s;
+                cookie->value = value;
+                cookie->value_len = value_end - value;
+                return pair_end;
+            }
+        }
+        s = pair_end;
+    }
+    return NULL;
+}
+
+/* Lua call spec: cookies = http_lib.parseCookies(cookie_header)
+* Returns table of all the cookies by name. First one wins in case the same name occurs more than
+* once, browsers send cookies with more specific path first.
+*/
+LUA_LIB_METHOD static int luaw_parse_cookies(lua_State *L) {
+    size_t len = 0;
+    const char* s = luaL_optlstring(L, 1, "", &len);
+    const char* end = s + len;
+    lua_newtable(L);
+
+    cookie_pair cookie;
+    while ((s = next_cookie(s, end, &cookie)) != NULL) {
+        lua_pushlstring(L, cookie.name, cookie.name_len);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, -3);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_pushlstring(L, cookie.value, cookie.value_len);
+            lua_rawset(L, -3);
+        } else {
+            lua_pop(L, 2);
+        }
+    }
+    return 1;
+}
+
+/* Lua call spec: value = http_lib.getCookie(cookie_header, name)
+* Looks up a single cookie by scanning the header, without building the whole cookies table.
+*/
+LUA_LIB_METHOD static int luaw_get_cookie(lua_State *L) {
+    size_t len = 0, name_len = 0;
+    const char* s = luaL_optlstring(L, 1, "", &len);
+    const char* name = luaL_checklstring(L, 2, &name_len);
+    const char* end = s + len;
+
+    cookie_pair cookie;
+    while ((s = next_cookie(s, end, &cookie)) != NULL) {
+        if ((cookie.name_len == name_len)&&(memcmp(cookie.name, name, name_len) == 0)) {
+            lua_pushlstring(L, cookie.value, cookie.value_len);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* HTTP response serialization. Status line and headers are serialized straight into the
+* connection's output buffer that is sent along with the response body in a single write. Heads that
+* don't fit in it - or responses not written directly to a connection - use a scratch buffer that
+* grows as needed and is reused across responses.
+*/
+typedef struct {
+    char* base;
+    size_t len;
+    size_t capacity;
+    bool growable;
+} head_buffer_t;
+
+static char* scratch_head_buffer = NULL;
+static size_t scratch_head_capacity = 0;
+
+static bool head_append(head_buffer_t* head, const char* str, size_t len) {
+    if (head->len + len > head->capacity) {
+        if (!head->growable) return false;
+
+        size_t capacity = (head->capacity > 0) ? head->capacity : CONN_BUFFER_SIZE;
+        while (capacity < head->len + len) capacity *= 2;
+        char* base = realloc(head->base, capacity);
+        if (base == NULL) return false;
+        head->base = scratch_head_buffer = base;
+        head->capacity = scratch_head_capacity = capacity;
+    }
+    memcpy(head->base + head->len, str, len);
+    head->len += len;
+    return true;
+}
+
+static const char* header_string(lua_State* L, int idx, size_t* len) {
+    switch(lua_type(L, idx)) {
+        case LUA_TSTRING:
+        case LUA_TNUMBER:
+            /* idx is always a copy of the table entry, so converting number in place is safe */
+            return lua_tolstring(L, idx, len);
+
+        case LUA_TBOOLEAN:
+            *len = lua_toboolean(L, idx) ? 4 : 5;
+            return lua_toboolean(L, idx) ? "true" : "false";
+
+        default:
+            raise_lua_error(L, "Invalid HTTP header %s: %s", (lua_gettop(L) == idx) ? "value" : "name", luaL_typename(L, idx));
+            return NULL;
+    }
+}
+
+static bool append_header(head_buffer_t* head, const char* name, size_t name_len, const char* value, size_t value_len) {
+    return ((head_append(head, name, name_len))&&(head_append(head, ": ", 2))&&
+            (head_append(head, value, value_len))&&(head_append(head, "\r\n", 2)));
+}
+
+/* Status lines "HTTP/1.x NNN Reason\r\n" pre-rendered for HTTP 1.0 and 1.1 and all the standard
+* status codes, indexed by minor version and status - 100 */
+#define MIN_STATUS 100
+#define MAX_STATUS 599
+
+typedef struct {
+    char* line;
+    size_t len;
+    size_t reason_len;
+} status_line_t;
+
+static status_line_t status_lines[2][MAX_STATUS - MIN_STATUS + 1];
+
+/* "Date: <IMF-fixdate>\r\n" header, formatted at most once per wall clock second. Keyed on time()
+ * rather than the loop's monotonic clock so that the header can't lag behind the actual second */
+static char cached_date[64];
+static size_t cached_date_len = 0;
+static time_t cached_date_time = 0;
+
+static const char* const week_days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char* const months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+static void refresh_cached_date() {
+    time_t now = time(NULL);
+    if ((cached_date_len > 0)&&(now == cached_date_time)) return;
+
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    cached_date_len = snprintf(cached_date, sizeof(cached_date), "Date: %s, %02d %s %d %02d:%02d:%02d GMT\r\n",
+        week_days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    cached_date_time = now;
+}
+
+/* returns pre-rendered status line if there is one and its reason matches the status message */
+static status_line_t* find_status_line(int major, int minor, int status, const char* mesg, size_t mesg_len) {
+    if ((major != 1)||(minor < 0)||(minor > 1)||(status < MIN_STATUS)||(status > MAX_STATUS)) return NULL;
+
+    status_line_t* status_line = &status_lines[minor][status - MIN_STATUS];
+    if (status_line->line == NULL) return NULL;
+    if (mesg != NULL) {
+        const char* reason = status_line->line + status_line->len - status_line->reason_len - 2;
+        if ((mesg_len != status_line->reason_len)||(memcmp(reason, mesg, mesg_len) != 0)) return NULL;
+    }
+    return status_line;
+}
+
+/* expects major version, minor version, status, status message and headers at stack indexes base to
+* base + 4. If date_pending is not NULL Date header is left out and *date_pending tells whether it
+* should be added when the head is sent */
+static bool serialize_response_head(lua_State* L, int base, head_buffer_t* head, bool* date_pending) {
+    if (!lua_isnumber(L, base + 2)) {
+        raise_lua_error(L, "HTTP response status not set");
+    }
+
+    int major = luaL_optinteger(L, base, 1);
+    int minor = luaL_optinteger(L, base + 1, 1);
+    int status = lua_tointeger(L, base + 2);
+    size_t mesg_len = 0;
+    const char* mesg = lua_isstring(L, base + 3) ? lua_tolstring(L, base + 3, &mesg_len) : NULL;
+    int headers = base + 4;
+
+    status_line_t* status_line = find_status_line(major, minor, status, mesg, mesg_len);
+    if (status_line != NULL) {
+        if (!head_append(head, status_line->line, status_line->len)) return false;
+    } else {
+        char first_line[64];
+        int len = snprintf(first_line, sizeof(first_line), "HTTP/%d.%d %d ", major, minor, status);
+        if ((!head_append(head, first_line, len))||(!head_append(head, (mesg ? mesg : ""), mesg_len))||(!head_append(head, "\r\n", 2))) {
+            return false;
+        }
+    }
+
+    bool has_date = false;
+
+    if (lua_istable(L, headers)) {
+        lua_pushnil(L);
+        while (lua_next(L, headers) != 0) {
+            size_t name_len = 0, value_len = 0;
+            lua_pushvalue(L, -2);
+            const char* name = header_string(L, -1, &name_len);
+            if ((name_len == 4)&&(strncasecmp(name, "Date", 4) == 0)) has_date = true;
+
+            bool fits = true;
+            if (lua_istable(L, -2)) {
+                /* multi-valued header, one header line per value */
+                int count = lua_rawlen(L, -2);
+                for (int i = 1; ((fits)&&(i <= count)); i++) {
+                    lua_rawgeti(L, -2, i);
+                    const char* value = header_string(L, lua_gettop(L), &value_len);
+                    fits = append_header(head, name, name_len, value, value_len);
+                    lua_pop(L, 1);
+                }
+            } else {
+                lua_pushvalue(L, -2);
+                const char* value = header_string(L, lua_gettop(L), &value_len);
+                fits = append_header(head, name, name_len, value, value_len);
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 2);
+
+            if (!fits) {
+                lua_pop(L, 1);
+                return false;
+            }
+        }
+    }
+
+    if (date_pending != NULL) {
+        *date_pending = !has_date;
+    } else if (!has_date) {
+        refresh_cached_date();
+        if (!head_append(head, cached_date, cached_date_len)) return false;
+    }
+    return head_append(head, "\r\n", 2);
+}
+
+/* Lua call spec: head = http_lib.serializeResponse(resp, conn)
+* Serializes status line and headers of resp. If conn is a connection they are written into its
+* output buffer to go out with the next conn:write() and nothing is returned. Otherwise - or if they
+* don't fit in the connection's buffer - serialized head is returned as a string.
+*/
+LUA_LIB_METHOD static int luaw_serialize_response(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 2);
+    connection_t* conn = to_connection(L, 2);
+    lua_getfield(L, 1, "major_version");
+    lua_getfield(L, 1, "minor_version");
+    lua_getfield(L, 1, "status");
+    lua_getfield(L, 1, "statusMesg");
+    lua_getfield(L, 1, "headers");
+
+    char* out = reserve_output(conn);
+    if (out != NULL) {
+        head_buffer_t head = {out, 0, CONN_BUFFER_SIZE, false};
+        if (serialize_response_head(L, 3, &head, NULL)) {
+            conn->out_len = head.len;
+            return 0;
+        }
+    }
+
+    head_buffer_t head = {scratch_head_buffer, 0, scratch_head_capacity, true};
+    if (!serialize_response_head(L, 3, &head, NULL)) {
+        return raise_lua_error(L, "Could not allocate memory for HTTP response head");
+    }
+    lua_pushlstring(L, head.base, head.len);
+    return 1;
+}
+
+/* Static routes. Responses for health checks, robots.txt, redirects and such never change, so they
+* are serialized once when the route is added. Requests that match one are answered straight from
+* the connection's read callback, without creating request and response objects or waking up any
+* Lua thread. Only HTTP/1.1 keep-alive requests understood by the fast path parser are served this
+* way, anything else is left to the route's Lua handler.
+*/
+#define MAX_STATIC_ROUTES 64
+
+typedef struct {
+    char* method;
+    char* path;
+    size_t path_len;
+    char* response;                         /* status line and headers followed by blank line and body */
+    size_t head_len;                        /* length of status line and headers, Date header goes here */
+    size_t len;
+    bool add_date;
+} static_route_t;
+
+static static_route_t static_routes[MAX_STATIC_ROUTES];
+static int static_route_count = 0;
+
+/* url is matched exactly, URLs with query string are left to the route's Lua handler */
+static static_route_t* find_static_route(const char* method, const char* url, size_t url_len) {
+    for (int i = 0; i < static_route_count; i++) {
+        static_route_t* route = &static_routes[i];
+        if ((route->path_len == url_len)&&(memcmp(route->path, url, url_len) == 0)&&(strcmp(route->method, method) == 0)) {
+            return route;
+        }
+    }
+    return NULL;
+}
+
+/* Writes responses of the static routes matching complete requests at the start of buff. Returns
+* number of bytes of the requests served, 0 if the first one is not for a static route. Responses are
+* written only if the socket takes them right away so that they never need a write request. */
+size_t serve_static_routes(connection_t* conn, const char* buff, size_t len) {
+    if ((static_route_count == 0)||(conn->lua_ref == NULL)||(conn->write_req.data != NULL)||(conn->out_len > 0)) {
+        return 0;
+    }
+
+    size_t served = 0;
+    while (served < len) {
+        fast_http_request_t req;
+        size_t req_len = fast_parse_http_request(buff + served, len - served, &req);
+        if ((req_len == 0)||(req.http_minor != 1)||(!req.keep_alive)) break;
+
+        static_route_t* route = find_static_route(req.method, req.url, req.url_len);
+        if (route == NULL) break;
+
+        uv_buf_t write_buffs[3];
+        unsigned int nbufs = 0;
+        write_buffs[nbufs++] = uv_buf_init(route->response, route->head_len);
+        if (route->add_date) {
+            refresh_cached_date();
+            write_buffs[nbufs++] = uv_buf_init(cached_date, cached_date_len);
+        }
+        write_buffs[nbufs++] = uv_buf_init(route->response + route->head_len, route->len - route->head_len);
+
+        size_t total = 0;
+        for (unsigned int i = 0; i < nbufs; i++) {
+            total += write_buffs[i].len;
+        }
+
+        int nwritten = uv_try_write((uv_stream_t*)&conn->handle, write_buffs, nbufs);
+        if ((nwritten > 0)&&((size_t)nwritten == total)) {
+            served += req_len;
+            continue;
+        }
+        if (nwritten > 0) {
+            /* rest of the response can't be sent without a write request, give up on the connection */
+            close_connection(conn, UV_ECANCELED);
+            return served + req_len;
+        }
+        /* socket is full, route's Lua handler will wait for it */
+        break;
+    }
+    return served;
+}
+
+/* Lua call spec: http_lib.addStaticRoute(method, path, resp)
+* Registers a static route. resp is a table with status, optional statusMesg, headers and body fields,
+* headers should include Content-Length. Path is matched exactly, adding a route for the same method
+* and path again replaces its response.
+*/
+LUA_LIB_METHOD static int luaw_add_static_route(lua_State *L) {
+    size_t method_len = 0, path_len = 0, body_len = 0;
+    const char* method = luaL_checklstring(L, 1, &method_len);
+    const char* path = luaL_checklstring(L, 2, &path_len);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_settop(L, 3);
+
+    lua_getfield(L, 3, "body");
+    const char* body = lua_isstring(L, 4) ? lua_tolstring(L, 4, &body_len) : "";
+    lua_pushinteger(L, 1);
+    lua_pushinteger(L, 1);
+    lua_getfield(L, 3, "status");
+    lua_getfield(L, 3, "statusMesg");
+    lua_getfield(L, 3, "headers");
+
+    bool add_date = false;
+    head_buffer_t head = {scratch_head_buffer, 0, scratch_head_capacity, true};
+    if (!serialize_response_head(L, 5, &head, &add_date)) {
+        return raise_lua_error(L, "Could not allocate memory for HTTP response head");
+    }
+
+    static_route_t* route = NULL;
+    for (int i = 0; ((route == NULL)&&(i < static_route_count)); i++) {
+        if ((static_routes[i].path_len == path_len)&&(memcmp(static_routes[i].path, path, path_len) == 0)&&(strcmp(static_routes[i].method, method) == 0)) {
+            route = &static_routes[i];
+        }
+    }
+    if (route == NULL) {
+        if (static_route_count == MAX_STATIC_ROUTES) {
+            return raise_lua_error(L, "Can not add more than %d static routes", MAX_STATIC_ROUTES);
+        }
+        route = &static_routes[static_route_count];
+        route->method = strndup(method, method_len);
+        route->path = strndup(path, path_len);
+        route->path_len = path_len;
+        if ((route->method == NULL)||(route->path == NULL)) {
+            free(route->method);
+            free(route->path);
+            return raise_lua_error(L, "Could not allocate memory for static route");
+        }
+        static_route_count++;
+    }
+
+    char* response = malloc(head.len + body_len);
+    if (response == NULL) {
+        return raise_lua_error(L, "Could not allocate memory for static route");
+    }
+    memcpy(response, head.base, head.len);
+    memcpy(response + head.len, body, body_len);
+
+    free(route->response);
+    route->response = response;
+    route->head_len = head.len - 2;
+    route->len = head.len + body_len;
+    route->add_date = add_date;
+    return 0;
+}
+
+/* Lua call spec: http_lib.setStatusMessages(status_codes)
+* Pre-renders status lines for all the status codes in status_codes table, which maps status to its
+* reason phrase. Responses whose statusMesg is the standard one use these lines as is.
+*/
+LUA_LIB_METHOD static int luaw_set_status_messages(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_pushnil(L);
+    while (lua_next(L, 1) != 0) {
+        int status = lua_tointeger(L, -2);
+        if ((lua_type(L, -2) == LUA_TNUMBER)&&(status >= MIN_STATUS)&&(status <= MAX_STATUS)&&(lua_type(L, -1) == LUA_TSTRING)) {
+            size_t reason_len = 0;
+            const char* reason = lua_tolstring(L, -1, &reason_len);
+
+            for (int minor = 0; minor <= 1; minor++) {
+                status_line_t* status_line = &status_lines[minor][status - MIN_STATUS];
+                size_t capacity = reason_len + 16;
+                char* line = malloc(capacity);
+                if (line == NULL) {
+                    return raise_lua_error(L, "Could not allocate memory for HTTP status line");
+                }
+                free(status_line->line);
+                status_line->len = snprintf(line, capacity, "HTTP/1.%d %03d %s\r\n", minor, status, reason);
+                status_line->reason_len = reason_len;
+                status_line->line = line;
+            }
+        }
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
 static const struct luaL_Reg luaw_http_lib[] = {
 	{"urlDecode", luaw_url_decode},
+	{"urlDecodeParam", luaw_url_decode_param},
+	{"checkUrlEncoding", luaw_check_url_encoding},
 	{"newHttpRequestParser", luaw_new_http_request_parser},
 	{"newHttpResponseParser", luaw_new_http_response_parser},
 	{"parseURL", luaw_parse_url},
+	{"canonicalHeaderName", luaw_canonical_header_name},
+	{"getHeader", luaw_get_header},
+	{"parseCookies", luaw_parse_cookies},
+	{"getCookie", luaw_get_cookie},
+	{"serializeResponse", luaw_serialize_response},
+	{"setStatusMessages", luaw_set_status_messages},
+	{"addStaticRoute", luaw_add_static_route},
+	{"newMultipartParser", luaw_new_multipart_parser},
     {NULL, NULL}  /* sentinel */
 };
 
+static const struct luaL_Reg header_index_methods[] = {
+	{"get", header_index_get},
+	{"materialize", header_index_materialize},
+	{NULL, NULL}  /* sentinel */
+};
+
 static const struct luaL_Reg http_parser_methods[] = {
 	{"parseHttp", parse_http},
+	{"parseHttpBatch", parse_http_batch},
 	{"initHttpParser", luaw_init_http_parser},
 	{NULL, NULL}  /* sentinel */
 };
 
 void luaw_init_http_lib (lua_State *L) {
+    init_header_names(L);
+    fast_http_init();
     make_metatable(L, LUA_HTTP_PARSER_META_TABLE, http_parser_methods);
+    make_metatable(L, LUA_HTTP_HEADER_INDEX_META_TABLE, header_index_methods);
+    luaw_init_multipart_lib(L);
     luaL_newlib(L, luaw_http_lib);
     lua_setglobal(L, "luaw_http_lib");
 }
@@ -27,6 +27,10 @@
 #define LUAW_HTTP_PARSER_H
 
 #define LUA_HTTP_PARSER_META_TABLE "__luaw_HTTP_parser_MT__"
+#define LUA_HTTP_HEADER_INDEX_META_TABLE "__luaw_HTTP_header_index_MT__"
+
+/* max headers whose offsets are retained for lazy decoding, requests with more headers are decoded eagerly */
+#define MAX_LAZY_HEADERS 64
 
 typedef enum {
 	starting_name = 0,
@@ -57,14 +61,79 @@ static const char *http_methods[] =
   };
 
 
+/* header name/value being parsed in batch mode. Points into the buffer currently being parsed,
+   earlier fragments from previous buffers are saved ("spilled") in a hidden request field */
+typedef struct {
+    const char* start;
+    size_t len;
+    bool spilled;
+}
+http_field_fragment;
+
+/* location of a header in the raw request buffer */
+typedef struct {
+    uint32_t name_off;
+    uint32_t name_len;
+    uint32_t value_off;
+    uint32_t value_len;
+    int slot;                               /* slot of well known header name, -1 for others */
+}
+http_header_offsets;
+
+/* Offsets of all the headers of a message retained for lazy decoding. Raw buffer the offsets point
+   into is kept alive in the userdata's user value */
+typedef struct {
+    int count;
+    http_header_offsets headers[];
+}
+luaw_header_index_t;
+
 typedef struct {
     http_parser parser;
     http_parser_cb_type http_cb;
     char* start;
     size_t len;
+
+    /* batch mode state */
+    lua_State* L;                           /* set only for the duration of parseHttpBatch() */
+    http_parser_cb_type last_cb;            /* last callback invoked, to detect fields split across buffers */
+    http_field_fragment header_name;
+    http_field_fragment header_value;
+
+    /* lazy headers state */
+    const char* buff;                       /* buffer being parsed, set only for the duration of parseHttpBatch() */
+    bool lazy_requested;                    /* caller asked for lazy headers */
+    bool lazy_active;                       /* headers are being recorded as offsets into lazy_base */
+    const char* lazy_base;
+    int header_count;
+    http_header_offsets headers[MAX_LAZY_HEADERS];
+
+    /* request size accounting against the configured limits, reset on every new message */
+    size_t url_bytes;
+    size_t header_bytes;
+    size_t headers_seen;
+    size_t body_bytes;
+    int limit_status;                       /* HTTP status of the limit exceeded, 0 if none */
 }
 luaw_http_parser_t;
 
+/* limits on size of incoming requests, 0 means no limit */
+typedef struct {
+    size_t max_url_length;
+    size_t max_header_count;
+    size_t max_header_bytes;
+    size_t max_body_size;
+}
+http_request_limits;
+
+extern http_request_limits request_limits;
+
+struct connection_s;
+
+/* writes responses of static routes matching the requests at the start of buff, see luaw_http_parser.c */
+extern size_t serve_static_routes(struct connection_s* conn, const char* buff, size_t len);
+
 extern void luaw_init_http_lib(lua_State *L);
+extern void luaw_configure_http_limits(lua_State *L, int config_idx);
 
 #endif
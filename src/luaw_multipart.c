@@ -0,0 +1,355 @@
+/*
+* Copyright (c) 2015 raksoras
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "uv.h"
+#include "luaw_common.h"
+#include "luaw_multipart.h"
+
+/* Streaming multipart/form-data parser. Body is fed to it one string at a time as it is read from the
+ * connection, parser returns one event per call along with the offset it has consumed the string
+ * till. Part data is returned as a range of the string passed in, so that it can be written out
+ * without making a copy of it. Only the few bytes at the end of a string that may be the beginning
+ * of a delimiter are carried over to the next call. */
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+/* Boyer-Moore-Horspool search for the delimiter */
+static const char* find_delimiter(luaw_multipart_parser_t* mp, const char* s, size_t n) {
+    size_t m = mp->delim_len;
+    if (n < m) return NULL;
+
+    const char last = mp->delim[m - 1];
+    size_t i = 0;
+    while (i <= n - m) {
+        char c = s[i + m - 1];
+        if ((c == last)&&(memcmp(s + i, mp->delim, m - 1) == 0)) {
+            return s + i;
+        }
+        i += mp->shift[(uint8_t)c];
+    }
+    return NULL;
+}
+
+/* returns position in s starting at or after from from which the rest of s is a proper prefix of
+ * the delimiter, n if there is no such position */
+static size_t partial_delimiter_start(luaw_multipart_parser_t* mp, const char* s, size_t n, size_t from) {
+    size_t q = (n >= mp->delim_len) ? (n - mp->delim_len + 1) : 0;
+    if (q < from) q = from;
+    for (; q < n; q++) {
+        if ((s[q] == mp->delim[0])&&(memcmp(s + q, mp->delim, n - q) == 0)) {
+            return q;
+        }
+    }
+    return n;
+}
+
+static int push_event(lua_State* L, multipart_event event, size_t offset) {
+    lua_pushinteger(L, event);
+    lua_pushinteger(L, offset);
+    return 2;
+}
+
+/* part data event: event, offset, str, i, j where data is string.sub(str, i, j) */
+static int push_data(lua_State* L, int str_idx, size_t start, size_t end, size_t offset) {
+    push_event(L, mp_event_part_data, offset);
+    lua_pushvalue(L, str_idx);
+    lua_pushinteger(L, start + 1);
+    lua_pushinteger(L, end);
+    return 5;
+}
+
+static int push_carried_data(lua_State* L, luaw_multipart_parser_t* mp, size_t len, size_t offset) {
+    push_event(L, mp_event_part_data, offset);
+    lua_pushlstring(L, mp->carry, len);
+    lua_pushinteger(L, 1);
+    lua_pushinteger(L, len);
+
+    mp->carry_len -= len;
+    memmove(mp->carry, mp->carry + len, mp->carry_len);
+    return 5;
+}
+
+static bool token_equals(const char* token, size_t len, const char* name) {
+    return ((strlen(name) == len)&&(strncasecmp(token, name, len) == 0));
+}
+
+static const char* skip_spaces(const char* s, const char* end) {
+    while ((s < end)&&((*s == ' ')||(*s == '\t'))) s++;
+    return s;
+}
+
+static const char* trim_trailing_spaces(const char* start, const char* end) {
+    while ((end > start)&&((end[-1] == ' ')||(end[-1] == '\t'))) end--;
+    return end;
+}
+
+/* pushes name and filename parameters of Content-Disposition header value, nil for missing ones */
+static void push_disposition_params(lua_State* L, const char* s, const char* end) {
+    const char* name = NULL;
+    const char* filename = NULL;
+    size_t name_len = 0, filename_len = 0;
+
+    while (s < end) {
+        s = skip_spaces(s, end);
+        const char* key = s;
+        while ((s < end)&&(*s != '=')&&(*s != ';')) s++;
+        const char* key_end = trim_trailing_spaces(key, s);
+
+        if ((s < end)&&(*s == '=')) {
+            s = skip_spaces(s + 1, end);
+            const char* value = s;
+            const char* value_end;
+            if ((s < end)&&(*s == '"')) {
+                value = ++s;
+                while ((s < end)&&(*s != '"')) {
+                    if ((*s == '\\')&&(s + 1 < end)) s++;
+                    s++;
+                }
+                value_end = s;
+                if (s < end) s++;
+                while ((s < end)&&(*s != ';')) s++;
+            } else {
+                while ((s < end)&&(*s != ';')) s++;
+                value_end = trim_trailing_spaces(value, s);
+            }
+
+            if (token_equals(key, key_end - key, "name")) {
+                name = value;
+                name_len = value_end - value;
+            } else if (token_equals(key, key_end - key, "filename")) {
+                filename = value;
+                filename_len = value_end - value;
+            }
+        }
+        if (s < end) s++;  /* ';' */
+    }
+
+    if (name) lua_pushlstring(L, name, name_len); else lua_pushnil(L);
+    if (filename) lua_pushlstring(L, filename, filename_len); else lua_pushnil(L);
+}
+
+/* part begin event: event, offset, field name, file name, content type */
+static int push_part_begin(lua_State* L, luaw_multipart_parser_t* mp, size_t offset) {
+    push_event(L, mp_event_part_begin, offset);
+    int params_idx = lua_gettop(L) + 1;
+    lua_pushnil(L);
+    lua_pushnil(L);
+    lua_pushnil(L);
+
+    const char* p = mp->headers;
+    const char* end = mp->headers + mp->headers_len;
+    while (p < end) {
+        const char* eol = p;
+        while ((eol < end)&&(*eol != '\r')) eol++;
+
+        const char* colon = memchr(p, ':', eol - p);
+        if (colon != NULL) {
+            const char* value = skip_spaces(colon + 1, eol);
+            const char* value_end = trim_trailing_spaces(value, eol);
+            if (token_equals(p, colon - p, "Content-Disposition")) {
+                push_disposition_params(L, value, value_end);
+                lua_replace(L, params_idx + 1);
+                lua_replace(L, params_idx);
+            } else if (token_equals(p, colon - p, "Content-Type")) {
+                lua_pushlstring(L, value, value_end - value);
+                lua_replace(L, params_idx + 2);
+            }
+        }
+        p = eol + 2;
+    }
+    return 5;
+}
+
+/* Lua call spec:
+*   event, new offset, ... = parser:parse(str, offset)
+*
+*   part begin:     event, new offset, field name, file name, content type
+*   part data:      event, new offset, str, i, j  where part data is string.sub(str, i, j)
+*   part end, multipart end, need more content: event, new offset
+*
+*   false, error message in case of malformed content. Offset is zero based, same as HTTP parser's.
+*/
+LUA_OBJ_METHOD static int multipart_parse(lua_State* L) {
+    luaw_multipart_parser_t* mp = luaL_checkudata(L, 1, LUA_MULTIPART_PARSER_META_TABLE);
+    size_t len = 0;
+    const char* str = luaL_checklstring(L, 2, &len);
+    size_t offset = luaL_optinteger(L, 3, 0);
+    if (offset > len) {
+        return error_to_lua(L, "Wrong offset into multipart content: len=%d, offset=%d", (int)len, (int)offset);
+    }
+
+    while (true) {
+        switch (mp->state) {
+            case mp_preamble:
+            case mp_part_data: {
+                bool in_data = (mp->state == mp_part_data);
+
+                if (mp->carry_len > 0) {
+                    /* try to complete delimiter carried over from the previous string */
+                    size_t n = MIN(mp->delim_len - mp->carry_len, len - offset);
+                    memcpy(mp->carry + mp->carry_len, str + offset, n);
+                    mp->carry_len += n;
+                    offset += n;
+
+                    if (mp->carry_len < mp->delim_len) {
+                        /* ran out of content before we could tell */
+                        size_t q = partial_delimiter_start(mp, mp->carry, mp->carry_len, 0);
+                        if ((in_data)&&(q > 0)) return push_carried_data(L, mp, q, offset);
+                        mp->carry_len -= q;
+                        memmove(mp->carry, mp->carry + q, mp->carry_len);
+                        return push_event(L, mp_event_none, offset);
+                    }
+
+                    if (memcmp(mp->carry, mp->delim, mp->delim_len) != 0) {
+                        size_t q = partial_delimiter_start(mp, mp->carry, mp->carry_len, 1);
+                        if (in_data) return push_carried_data(L, mp, q, offset);
+                        mp->carry_len -= q;
+                        memmove(mp->carry, mp->carry + q, mp->carry_len);
+                        continue;
+                    }
+                    mp->carry_len = 0;
+                } else {
+                    if (offset == len) return push_event(L, mp_event_none, offset);
+
+                    const char* found = find_delimiter(mp, str + offset, len - offset);
+                    if (found == NULL) {
+                        size_t start = offset;
+                        size_t q = offset + partial_delimiter_start(mp, str + offset, len - offset, 0);
+                        mp->carry_len = len - q;
+                        memcpy(mp->carry, str + q, mp->carry_len);
+                        offset = len;
+                        if ((in_data)&&(q > start)) return push_data(L, 2, start, q, offset);
+                        return push_event(L, mp_event_none, offset);
+                    }
+
+                    size_t pos = found - str;
+                    if ((in_data)&&(pos > offset)) return push_data(L, 2, offset, pos, pos);
+                    offset = pos + mp->delim_len;
+                }
+
+                /* delimiter matched */
+                mp->state = mp_after_delimiter;
+                mp->pending = 0;
+                if (in_data) return push_event(L, mp_event_part_end, offset);
+                break;
+            }
+
+            case mp_after_delimiter:
+                while (offset < len) {
+                    char ch = str[offset++];
+                    if (mp->pending == '-') {
+                        if (ch != '-') return error_to_lua(L, "Malformed multipart delimiter");
+                        mp->state = mp_epilogue;
+                        return push_event(L, mp_event_multipart_end, offset);
+                    }
+                    if (mp->pending == '\r') {
+                        if (ch != '\n') return error_to_lua(L, "Malformed multipart delimiter");
+                        mp->state = mp_part_headers;
+                        mp->headers_len = 0;
+                        break;
+                    }
+                    if ((ch == '-')||(ch == '\r')) {
+                        mp->pending = ch;
+                    } else if ((ch != ' ')&&(ch != '\t')) {
+                        return error_to_lua(L, "Malformed multipart delimiter");
+                    }
+                }
+                if (mp->state == mp_after_delimiter) return push_event(L, mp_event_none, offset);
+                break;
+
+            case mp_part_headers:
+                while (offset < len) {
+                    if (mp->headers_len == MULTIPART_MAX_PART_HEADERS) {
+                        return error_to_lua(L, "Multipart part headers too long");
+                    }
+                    char ch = str[offset++];
+                    char* h = mp->headers;
+                    size_t hlen = ++mp->headers_len;
+                    h[hlen - 1] = ch;
+
+                    /* headers end with an empty line, part may have no headers at all */
+                    if ((ch == '\n')&&(hlen >= 2)&&(h[hlen - 2] == '\r')&&
+                        ((hlen == 2)||((hlen >= 4)&&(h[hlen - 3] == '\n')&&(h[hlen - 4] == '\r'))))
+                    {
+                        mp->state = mp_part_data;
+                        return push_part_begin(L, mp, offset);
+                    }
+                }
+                return push_event(L, mp_event_none, offset);
+
+            case mp_epilogue:
+                return push_event(L, mp_event_none, len);
+        }
+    }
+}
+
+/* Lua call spec: parser = luaw_http_lib.newMultipartParser(boundary) */
+int luaw_new_multipart_parser(lua_State* L) {
+    size_t len = 0;
+    const char* boundary = luaL_checklstring(L, 1, &len);
+    if ((len == 0)||(len > MULTIPART_MAX_BOUNDARY)) {
+        return error_to_lua(L, "Invalid multipart boundary length: %d", (int)len);
+    }
+
+    luaw_multipart_parser_t* mp = lua_newuserdata(L, sizeof(luaw_multipart_parser_t));
+    luaL_setmetatable(L, LUA_MULTIPART_PARSER_META_TABLE);
+    mp->state = mp_preamble;
+    mp->pending = 0;
+    mp->headers_len = 0;
+
+    memcpy(mp->delim, "\r\n--", 4);
+    memcpy(mp->delim + 4, boundary, len);
+    mp->delim_len = len + 4;
+
+    size_t m = mp->delim_len;
+    for (int c = 0; c < 256; c++) {
+        mp->shift[c] = m;
+    }
+    for (size_t k = 0; k < m - 1; k++) {
+        mp->shift[(uint8_t)mp->delim[k]] = m - 1 - k;
+    }
+
+    /* first delimiter may be at the very beginning of the body, without the CRLF before it */
+    memcpy(mp->carry, "\r\n", 2);
+    mp->carry_len = 2;
+    return 1;
+}
+
+static const struct luaL_Reg multipart_parser_methods[] = {
+    {"parse", multipart_parse},
+    {NULL, NULL}  /* sentinel */
+};
+
+void luaw_init_multipart_lib(lua_State* L) {
+    make_metatable(L, LUA_MULTIPART_PARSER_META_TABLE, multipart_parser_methods);
+}
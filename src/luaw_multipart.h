@@ -0,0 +1,77 @@
+/*
+* Copyright (c) 2015 raksoras
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#ifndef LUAW_MULTIPART_H
+
+#define LUAW_MULTIPART_H
+
+#define LUA_MULTIPART_PARSER_META_TABLE "__luaw_multipart_parser_MT__"
+
+/* RFC 2046 caps boundary length at 70 chars, delimiter is CRLF followed by "--" and the boundary */
+#define MULTIPART_MAX_BOUNDARY 70
+#define MULTIPART_MAX_DELIMITER (MULTIPART_MAX_BOUNDARY + 4)
+#define MULTIPART_MAX_PART_HEADERS 8192
+
+typedef enum {
+    mp_preamble = 0,
+    mp_after_delimiter,
+    mp_part_headers,
+    mp_part_data,
+    mp_epilogue
+}
+multipart_state;
+
+/* events returned by multipart parser:parse(). Order is important and must match the Lua table
+ * they are mapped to in luaw_http.lua */
+typedef enum {
+    mp_event_none = 1,
+    mp_event_part_begin,
+    mp_event_part_data,
+    mp_event_part_end,
+    mp_event_multipart_end
+}
+multipart_event;
+
+typedef struct {
+    multipart_state state;
+    char pending;                                   /* first char of "--" or CRLF after delimiter */
+
+    /* delimiter and its Boyer-Moore-Horspool bad character shift table */
+    size_t delim_len;
+    char delim[MULTIPART_MAX_DELIMITER];
+    uint8_t shift[256];
+
+    /* tail of the previous string that may be the beginning of a delimiter */
+    size_t carry_len;
+    char carry[MULTIPART_MAX_DELIMITER];
+
+    /* part headers collected so far */
+    size_t headers_len;
+    char headers[MULTIPART_MAX_PART_HEADERS];
+}
+luaw_multipart_parser_t;
+
+extern int luaw_new_multipart_parser(lua_State* L);
+extern void luaw_init_multipart_lib(lua_State* L);
+
+#endif
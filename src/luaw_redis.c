@@ -0,0 +1,403 @@
+/*
+* Copyright (c) 2015 raksoras
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "uv.h"
+#include "luaw_common.h"
+#include "luaw_redis.h"
+#include "luaw_buffer.h"
+
+/* Redis serialization protocol (RESP2 and RESP3) support: encoding of commands and incremental
+ * parsing of replies. Socket I/O, connection pooling and pipelining are done in luaw_redis.lua */
+
+static const char* kind_names[] = {NULL, "error", "push"};
+
+static const char* find_crlf(const char* p, const char* end) {
+    while (p < end) {
+        const char* lf = memchr(p, '\n', end - p);
+        if (lf == NULL) return NULL;
+        if ((lf > p)&&(*(lf - 1) == '\r')) return lf - 1;
+        p = lf + 1;
+    }
+    return NULL;
+}
+
+/* longest integer accepted, so that value * 10 + digit can never overflow a long long */
+#define MAX_INT_DIGITS 18
+
+static bool parse_int(const char* p, const char* end, long long* result) {
+    bool negative = false;
+    long long value = 0;
+
+    if ((p < end)&&(*p == '-')) {
+        negative = true;
+        p++;
+    } else if ((p < end)&&(*p == '+')) {
+        p++;
+    }
+    if ((p == end)||((end - p) > MAX_INT_DIGITS)) return false;
+
+    while (p < end) {
+        char c = *p++;
+        if ((c < '0')||(c > '9')) return false;
+        value = (value * 10) + (c - '0');
+    }
+    *result = negative ? -value : value;
+    return true;
+}
+
+static bool parse_double(const char* p, const char* end, double* result) {
+    char num[64];
+    size_t len = end - p;
+    if ((len == 0)||(len >= sizeof(num))) return false;
+
+    memcpy(num, p, len);
+    num[len] = '\0';
+    char* num_end;
+    *result = strtod(num, &num_end);
+    return (num_end == (num + len));
+}
+
+/* Finds where the reply starting at buf[*pos] ends without building its Lua value, skipping over bulk
+ * payloads by their declared length. This keeps checking a reply that is still arriving cheap. On
+ * REPLY_INCOMPLETE *need is set to the buffer length below which the reply can not be complete. */
+static reply_status scan_reply(const char* buf, size_t len, size_t* pos, int depth, size_t* need) {
+next_reply:
+    if (depth > REDIS_MAX_REPLY_DEPTH) return REPLY_PROTOCOL_ERROR;
+
+    size_t start = *pos;
+    if (start >= len) {
+        *need = start + 3;
+        return REPLY_INCOMPLETE;
+    }
+
+    const char* line_end = find_crlf(buf + start + 1, buf + len);
+    if (line_end == NULL) {
+        *need = len + 1;
+        return REPLY_INCOMPLETE;
+    }
+
+    char type = buf[start];
+    size_t next = (line_end + 2) - buf;
+    long long n, count = 0;
+
+    switch (type) {
+        case '+': case '-': case ':': case ',': case '#': case '_': case '(':
+            break;
+
+        case '$': case '!': case '=':
+            if (!parse_int(buf + start + 1, line_end, &n)) return REPLY_PROTOCOL_ERROR;
+            if (n >= 0) {
+                if ((size_t)(len - next) < (size_t)n + 2) {
+                    *need = next + (size_t)n + 2;
+                    return REPLY_INCOMPLETE;
+                }
+                next += (size_t)n + 2;
+            }
+            break;
+
+        case '*': case '~': case '>': case '%': case '|':
+            if (!parse_int(buf + start + 1, line_end, &n)) return REPLY_PROTOCOL_ERROR;
+            if ((n < 0)&&((type == '%')||(type == '|'))) return REPLY_PROTOCOL_ERROR;
+            count = ((type == '%')||(type == '|')) ? (2 * n) : n;
+            for (long long i = 0; i < count; i++) {
+                reply_status rc = scan_reply(buf, len, &next, depth + 1, need);
+                if (rc == REPLY_INCOMPLETE) {
+                    /* every element still to come takes at least 3 bytes */
+                    *need += 3 * (size_t)(count - i - 1);
+                }
+                if (rc != REPLY_COMPLETE) return rc;
+            }
+            if (type == '|') {
+                /* attribute is followed by the actual reply at the same depth. Loop rather than recurse
+                 * so that a run of attributes can not exhaust the C stack */
+                *pos = next;
+                goto next_reply;
+            }
+            break;
+
+        default:
+            return REPLY_PROTOCOL_ERROR;
+    }
+
+    *pos = next;
+    return REPLY_COMPLETE;
+}
+
+/* Parses one reply starting at buf[*pos] and pushes its Lua value onto the stack. Returns
+ * REPLY_INCOMPLETE if the buffer ends before the reply does, in which case stack contents above
+ * the original top are undefined and should be discarded by the caller. Null replies are pushed
+ * as nil at the top level and as luaw_redis_lib.null inside aggregates so that they don't punch
+ * holes in arrays. */
+static reply_status parse_reply(lua_State* L, const char* buf, size_t len, size_t* pos, int depth, reply_kind* kind) {
+next_reply:
+    if (depth > REDIS_MAX_REPLY_DEPTH) return REPLY_PROTOCOL_ERROR;
+    luaL_checkstack(L, 4, "Redis reply nested too deep");
+
+    const char* start = buf + *pos;
+    const char* end = buf + len;
+    if (start >= end) return REPLY_INCOMPLETE;
+
+    const char* line_end = find_crlf(start + 1, end);
+    if (line_end == NULL) return REPLY_INCOMPLETE;
+
+    char type = *start;
+    const char* line = start + 1;
+    size_t next = (line_end + 2) - buf;
+    long long n;
+    double d;
+
+    switch (type) {
+        case '+':   /* simple string */
+        case '(':   /* big number, returned as string */
+            lua_pushlstring(L, line, line_end - line);
+            break;
+
+        case '-':   /* simple error */
+            if (kind) *kind = REPLY_ERROR;
+            if (depth > 0) {
+                /* errors nested in aggregates (e.g. EXEC) are returned as {err = mesg} */
+                lua_createtable(L, 0, 1);
+                lua_pushlstring(L, line, line_end - line);
+                lua_setfield(L, -2, "err");
+            } else {
+                lua_pushlstring(L, line, line_end - line);
+            }
+            break;
+
+        case ':':   /* integer */
+            if (!parse_int(line, line_end, &n)) return REPLY_PROTOCOL_ERROR;
+            lua_pushnumber(L, (lua_Number)n);
+            break;
+
+        case ',':   /* double */
+            if (!parse_double(line, line_end, &d)) return REPLY_PROTOCOL_ERROR;
+            lua_pushnumber(L, d);
+            break;
+
+        case '#':   /* boolean */
+            if (line_end - line != 1) return REPLY_PROTOCOL_ERROR;
+            lua_pushboolean(L, (*line == 't'));
+            break;
+
+        case '_':   /* null */
+            if (depth > 0) {
+                lua_pushlightuserdata(L, NULL);
+            } else {
+                lua_pushnil(L);
+            }
+            break;
+
+        case '$':   /* bulk string */
+        case '!':   /* bulk error */
+        case '=':   /* verbatim string */
+            if (!parse_int(line, line_end, &n)) return REPLY_PROTOCOL_ERROR;
+            if (n < 0) {
+                /* RESP2 null bulk string */
+                if (depth > 0) {
+                    lua_pushlightuserdata(L, NULL);
+                } else {
+                    lua_pushnil(L);
+                }
+                break;
+            }
+            if ((size_t)(len - next) < (size_t)n + 2) return REPLY_INCOMPLETE;
+            if ((buf[next + n] != '\r')||(buf[next + n + 1] != '\n')) return REPLY_PROTOCOL_ERROR;
+
+            const char* str = buf + next;
+            size_t str_len = (size_t)n;
+            if (type == '=') {
+                /* skip three letter format prefix like "txt:" */
+                if (str_len < 4) return REPLY_PROTOCOL_ERROR;
+                str += 4;
+                str_len -= 4;
+            }
+            if ((type == '!')&&(depth > 0)) {
+                lua_createtable(L, 0, 1);
+                lua_pushlstring(L, str, str_len);
+                lua_setfield(L, -2, "err");
+            } else {
+                lua_pushlstring(L, str, str_len);
+            }
+            if ((type == '!')&&(kind)) *kind = REPLY_ERROR;
+            next += n + 2;
+            break;
+
+        case '>':   /* push */
+            if (kind) *kind = REPLY_PUSH;
+            /* fall through */
+        case '*':   /* array */
+        case '~':   /* set, returned as array */
+            if (!parse_int(line, line_end, &n)) return REPLY_PROTOCOL_ERROR;
+            if (n < 0) {
+                /* RESP2 null array */
+                if (depth > 0) {
+                    lua_pushlightuserdata(L, NULL);
+                } else {
+                    lua_pushnil(L);
+                }
+                break;
+            }
+            lua_createtable(L, (n < 1024) ? (int)n : 1024, 0);
+            for (long long i = 1; i <= n; i++) {
+                reply_status rc = parse_reply(L, buf, len, &next, depth + 1, NULL);
+                if (rc != REPLY_COMPLETE) return rc;
+                lua_rawseti(L, -2, (int)i);
+            }
+            break;
+
+        case '%':   /* map */
+            if (!parse_int(line, line_end, &n)) return REPLY_PROTOCOL_ERROR;
+            if (n < 0) return REPLY_PROTOCOL_ERROR;
+            lua_createtable(L, 0, (n < 1024) ? (int)n : 1024);
+            for (long long i = 0; i < n; i++) {
+                reply_status rc = parse_reply(L, buf, len, &next, depth + 1, NULL);
+                if (rc != REPLY_COMPLETE) return rc;
+                rc = parse_reply(L, buf, len, &next, depth + 1, NULL);
+                if (rc != REPLY_COMPLETE) return rc;
+                lua_rawset(L, -3);
+            }
+            break;
+
+        case '|':   /* attribute, out of band data preceding actual reply. We parse it and drop it */
+            if (!parse_int(line, line_end, &n)) return REPLY_PROTOCOL_ERROR;
+            if (n < 0) return REPLY_PROTOCOL_ERROR;
+            for (long long i = 0; i < (2 * n); i++) {
+                reply_status rc = parse_reply(L, buf, len, &next, depth + 1, NULL);
+                if (rc != REPLY_COMPLETE) return rc;
+                lua_pop(L, 1);
+            }
+            /* loop to the actual reply, see scan_reply() */
+            *pos = next;
+            goto next_reply;
+
+        default:
+            return REPLY_PROTOCOL_ERROR;
+    }
+
+    *pos = next;
+    return REPLY_COMPLETE;
+}
+
+/* lua call spec: reply, nextOffset, kind, need = luaw_redis_lib.parseReply(str, offset)
+Parses one reply from str, which can be a string or a buffer, starting at offset (1 based, defaults
+to 1). kind is "error" for error replies and "push" for RESP3 out of band push messages, nil
+otherwise. If str does not contain a complete reply yet only need is returned - at reply, nextOffset
+and kind positions are nils - which is the length str must reach before the reply can be complete.
+Raises error if str is not a valid RESP reply.
+*/
+LUA_LIB_METHOD static int parse_reply_lua(lua_State* l_thread) {
+    size_t len = 0;
+    const char* buf;
+    luaw_buffer_t* buffer = to_buffer(l_thread, 1);
+    if (buffer != NULL) {
+        buf = buffer->base;
+        len = buffer->len;
+    } else {
+        buf = luaL_checklstring(l_thread, 1, &len);
+    }
+    lua_Integer offset = luaL_optinteger(l_thread, 2, 1);
+    if ((offset < 1)||((size_t)offset > len + 1)) {
+        return raise_lua_error(l_thread, "Invalid offset %d", (int)offset);
+    }
+
+    size_t pos = offset - 1;
+    size_t need = 0;
+    reply_status rc = scan_reply(buf, len, &pos, 0, &need);
+    if (rc == REPLY_INCOMPLETE) {
+        lua_pushnil(l_thread);
+        lua_pushnil(l_thread);
+        lua_pushnil(l_thread);
+        lua_pushnumber(l_thread, (lua_Number)need);
+        return 4;
+    }
+
+    pos = offset - 1;
+    reply_kind kind = REPLY_VALUE;
+    if (rc == REPLY_COMPLETE) {
+        rc = parse_reply(l_thread, buf, len, &pos, 0, &kind);
+    }
+    if (rc != REPLY_COMPLETE) {
+        return raise_lua_error(l_thread, "Redis protocol error at offset %d", (int)(offset));
+    }
+
+    lua_pushinteger(l_thread, pos + 1);
+    if (kind_names[kind]) {
+        lua_pushstring(l_thread, kind_names[kind]);
+        return 3;
+    }
+    return 2;
+}
+
+static void add_bulk_header(luaL_Buffer* b, char prefix, size_t n) {
+    char header[32];
+    int len = snprintf(header, sizeof(header), "%c%lu\r\n", prefix, (unsigned long)n);
+    luaL_addlstring(b, header, len);
+}
+
+/* lua call spec: str = luaw_redis_lib.encodeCommand(cmd, arg1, arg2...)
+Encodes a command as RESP array of bulk strings. Arguments must be strings or numbers.
+*/
+LUA_LIB_METHOD static int encode_command(lua_State* l_thread) {
+    int argc = lua_gettop(l_thread);
+    if (argc == 0) {
+        return raise_lua_error(l_thread, "Redis command missing");
+    }
+
+    luaL_Buffer b;
+    luaL_buffinit(l_thread, &b);
+    add_bulk_header(&b, '*', argc);
+
+    for (int i = 1; i <= argc; i++) {
+        size_t len;
+        const char* arg = lua_tolstring(l_thread, i, &len);
+        if (arg == NULL) {
+            return raise_lua_error(l_thread, "Invalid Redis command argument #%d of type %s", i, luaL_typename(l_thread, i));
+        }
+        add_bulk_header(&b, '$', len);
+        luaL_addlstring(&b, arg, len);
+        luaL_addlstring(&b, "\r\n", 2);
+    }
+
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static const struct luaL_Reg luaw_redis_lib[] = {
+    {"parseReply", parse_reply_lua},
+    {"encodeCommand", encode_command},
+    {NULL, NULL}  /* sentinel */
+};
+
+void luaw_init_redis_lib (lua_State *L) {
+    luaL_newlib(L, luaw_redis_lib);
+    lua_pushlightuserdata(L, NULL);
+    lua_setfield(L, -2, "null");
+    lua_setglobal(L, "luaw_redis_lib");
+}
@@ -0,0 +1,46 @@
+/*
+* Copyright (c) 2015 raksoras
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+#ifndef LUAW_REDIS_H
+
+#define LUAW_REDIS_H
+
+/* max nesting level of aggregate replies (arrays, maps, sets...) */
+#define REDIS_MAX_REPLY_DEPTH 32
+
+typedef enum {
+    REPLY_PROTOCOL_ERROR = -1,
+    REPLY_INCOMPLETE = 0,
+    REPLY_COMPLETE
+}
+reply_status;
+
+typedef enum {
+    REPLY_VALUE = 0,
+    REPLY_ERROR,
+    REPLY_PUSH
+}
+reply_kind;
+
+extern void luaw_init_redis_lib(lua_State *L);
+
+#endif
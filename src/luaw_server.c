@@ -37,6 +37,7 @@
 #include "uv.h"
 #include "luaw_common.h"
 #include "luaw_logging.h"
+#include "luaw_http_parser.h"
 #include "luaw_tcp.h"
 #include "lfs.h"
 
@@ -135,15 +136,16 @@ void init_luaw_server(lua_State* L) {
         lua_getfield(L, -1, "server_ip");
         if (lua_isstring(L, -1)) {
             server_ip = (char *)lua_tostring(L, -1);
-            lua_pop(L, 1);
         }
+        lua_pop(L, 1);
 
         lua_getfield(L, -1, "server_port");
         if (lua_isnumber(L, -1)) {
             server_port = lua_tointeger(L, -1);
-            lua_pop(L, 1);
         }
+        lua_pop(L, 1);
 
+        luaw_configure_http_limits(L, lua_gettop(L));
         lua_pop(L, 1);  //pop luaw_server_config object
     }
 
@@ -39,9 +39,15 @@
 #include "http_parser.h"
 #include "luaw_http_parser.h"
 #include "luaw_tcp.h"
+#include "luaw_buffer.h"
 #include "lfs.h"
 
 
+static void on_alloc(uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf);
+
+/* lua_ref of a lingering conn points here once its Lua userdata is delinked, so that the conn still
+ * counts as open till it closes itself */
+static connection_t* lingering_ref = NULL;
 
 connection_t* new_connection(lua_State* L) {
     connection_t* conn = (connection_t*)calloc(1, sizeof(connection_t));
@@ -99,6 +105,24 @@ static void free_tcp_handle(uv_handle_t* handle) {
     GC_REF(conn)
 }
 
+static void resume_reader(connection_t* conn, const int status) {
+    if (conn->lua_reader_tid) {
+        lua_rawgeti(l_global, LUA_REGISTRYINDEX, resume_thread_fn_ref);
+        lua_pushinteger(l_global, conn->lua_reader_tid);
+        if ((status == 0)||(status == UV_EOF)) {
+            lua_pushboolean(l_global, 0);
+            lua_pushliteral(l_global, "EOF");
+        } else {
+            /* error */
+            lua_pushboolean(l_global, 0);
+            lua_pushstring(l_global, uv_strerror(status));
+        }
+
+        conn->lua_reader_tid = 0;
+        resume_lua_thread(l_global, 3, 2, 0);
+    }
+}
+
 void close_connection(connection_t* conn, const int status) {
     /* conn->lua_ref == NULL also acts as a flag to mark that this conn has been closed */
     if ((conn == NULL)||(conn->lua_ref == NULL)) return;
@@ -117,21 +141,7 @@ void close_connection(connection_t* conn, const int status) {
 
 
     /* unblock reader thread */
-    if (conn->lua_reader_tid) {
-        lua_rawgeti(l_global, LUA_REGISTRYINDEX, resume_thread_fn_ref);
-        lua_pushinteger(l_global, conn->lua_reader_tid);
-        if ((status == 0)||(status == UV_EOF)) {
-            lua_pushboolean(l_global, 0);
-            lua_pushliteral(l_global, "EOF");
-        } else {
-            /* error */
-            lua_pushboolean(l_global, 0);
-            lua_pushstring(l_global, uv_strerror(status));
-        }
-
-        conn->lua_reader_tid = 0;
-        resume_lua_thread(l_global, 3, 2, 0);
-    }
+    resume_reader(conn, status);
 
     /* unblock writer thread */
     if (conn->lua_writer_tid) {
@@ -151,6 +161,39 @@ void close_connection(connection_t* conn, const int status) {
     }
 }
 
+/* returns connection represented by the Lua value at idx, NULL if it is not an open connection */
+connection_t* to_connection(lua_State* L, int idx) {
+    connection_t* conn = NULL;
+    connection_t** cr = lua_touserdata(L, idx);
+    if ((cr != NULL)&&(lua_getmetatable(L, idx))) {
+        luaL_getmetatable(L, LUA_CONNECTION_META_TABLE);
+        if (lua_rawequal(L, -1, -2)) conn = *cr;
+        lua_pop(L, 2);
+    }
+    return conn;
+}
+
+/* Writes short canned response without involving any Lua thread and closes the connection. The
+ * response is written only if the socket can take all of it right away, which is practically always
+ * the case for a response that is a few hundred bytes long */
+void reject_connection(connection_t* conn, const char* response, size_t len) {
+    if ((conn == NULL)||(conn->lua_ref == NULL)||(conn->lingering)) return;
+
+    uv_buf_t buff = uv_buf_init((char*)response, len);
+    uv_try_write((uv_stream_t*)&conn->handle, &buff, 1);
+    linger_close(conn);
+}
+
+/* Returns connection's output buffer, CONN_BUFFER_SIZE bytes long, for the caller to serialize HTTP
+ * message head into and then set conn->out_len. The head is sent along with the content of the next
+ * conn:write() in a single write request. NULL if the buffer is in use by a write in progress */
+char* reserve_output(connection_t* conn) {
+    if ((conn == NULL)||(conn->lua_ref == NULL)||(conn->write_req.data != NULL)||(conn->out_len > 0)) {
+        return NULL;
+    }
+    return conn->out_buffer;
+}
+
 LIBUV_CALLBACK static void on_conn_timeout(uv_timer_t* timer) {
     /* Either connect,read or write timed out, close the connection */
     connection_t* conn = GET_CONN_OR_RETURN(timer);
@@ -170,16 +213,88 @@ static void stop_timer(uv_timer_t* timer) {
     }
 }
 
+LIBUV_CALLBACK static void on_linger_shutdown(uv_shutdown_t* shutdown_req, int status) {
+    free(shutdown_req);
+}
+
+LIBUV_CALLBACK static void on_linger_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
+    connection_t* conn = GET_CONN_OR_RETURN(stream);
+    if ((nread < 0)&&(nread != UV_ENOBUFS)) {
+        /* peer is done sending, closing now can not reset the connection */
+        close_connection(conn, nread);
+        return;
+    }
+    conn->read_len = 0; //discard whatever peer is still sending
+}
+
+/* Closes the connection without losing the response written to it. Closing a socket with unread
+ * input makes the kernel reset the connection, which may destroy the response before the peer reads
+ * it, typically when we reject a request whose body is still on its way. Instead we shut down the
+ * write side, which sends FIN after all pending writes, and keep reading and discarding the input
+ * for up to LINGER_TIMEOUT ms or till the peer closes its side, whichever comes first. The conn is
+ * delinked from Lua right away and appears closed there */
+void linger_close(connection_t* conn) {
+    if ((conn == NULL)||(conn->lua_ref == NULL)||(conn->lingering)) return;
+
+    uv_stream_t* stream = (uv_stream_t*)&conn->handle;
+    if (conn->read_end_status != 0) {
+        /* peer has already closed its side */
+        close_connection(conn, UV_EOF);
+        return;
+    }
+
+    uv_shutdown_t* shutdown_req = malloc(sizeof(uv_shutdown_t));
+    if ((shutdown_req == NULL)||(uv_shutdown(shutdown_req, stream, on_linger_shutdown) != 0)) {
+        free(shutdown_req);
+        close_connection(conn, UV_EOF);
+        return;
+    }
+
+    conn->lingering = true;
+    conn->read_len = 0;
+    conn->read_paused = false;
+    conn->request_start = false;
+    uv_read_stop(stream);
+    if (uv_read_start(stream, on_alloc, on_linger_read) != 0) {
+        close_connection(conn, UV_EOF);
+        return;
+    }
+    stop_timer(&conn->read_timer);
+    start_timer(&conn->read_timer, LINGER_TIMEOUT);
+
+    *(conn->lua_ref) = NULL;
+    conn->lua_ref = &lingering_ref;
+    resume_reader(conn, UV_EOF);
+}
+
+/* lua call spec: conn:close(tid)
+Closing thread itself is never resumed. Any other thread blocked reading from or writing to this
+connection is resumed with EOF, which allows one thread to cancel I/O another thread is blocked on.
+*/
 LUA_OBJ_METHOD static int close_connection_lua(lua_State* l_thread) {
     LUA_GET_CONN_OR_RETURN(l_thread, 1, conn);
 
-    /* being called from lua, no reason to resume thread */
-    conn->lua_reader_tid = 0;
-    conn->lua_writer_tid = 0;
+    /* being called from lua, no reason to resume the calling thread */
+    int tid = lua_tointeger(l_thread, 2);
+    if ((tid == 0)||(conn->lua_reader_tid == tid)) conn->lua_reader_tid = 0;
+    if ((tid == 0)||(conn->lua_writer_tid == tid)) conn->lua_writer_tid = 0;
     close_connection(conn, UV_EOF);
     return 0;
 }
 
+/* lua call spec: conn:lingerClose(tid)
+Like conn:close() but makes sure the response already written reaches the peer even if the peer is
+still sending request body, see linger_close()
+*/
+LUA_OBJ_METHOD static int linger_close_lua(lua_State* l_thread) {
+    LUA_GET_CONN_OR_RETURN(l_thread, 1, conn);
+
+    int tid = lua_tointeger(l_thread, 2);
+    if ((tid == 0)||(conn->lua_reader_tid == tid)) conn->lua_reader_tid = 0;
+    linger_close(conn);
+    return 0;
+}
+
 LUA_OBJ_METHOD static int connection_gc(lua_State *L) {
     LUA_GET_CONN_OR_RETURN(L, 1, conn);
 
@@ -229,17 +344,52 @@ LIBUV_API static void on_read(uv_stream_t* stream, ssize_t nread, const uv_buf_t
     }
 
     if (nread > 0) {
-        /* success: send read bytes to coroutine if one is waiting */
+        if (conn->lua_reader_tid == 0) {
+            /* no coroutine waiting, keep bytes in the buffer till next conn:read(). This happens
+               when peer pipelines requests or responses. Stop reading when buffer is full */
+            conn->read_len += nread;
+            if (conn->read_len >= CONN_BUFFER_SIZE) {
+                uv_read_stop(stream);
+                conn->read_paused = true;
+            }
+            return;
+        }
+
+        size_t len = conn->read_len + nread;
+        if (conn->request_start) {
+            /* requests for static routes are answered right here, reader only gets the rest */
+            size_t served = serve_static_routes(conn, conn->read_buffer, len);
+            if (conn->lua_ref == NULL) return;
+            if (served > 0) {
+                len -= served;
+                memmove(conn->read_buffer, conn->read_buffer + served, len);
+                if (len == 0) {
+                    conn->read_len = 0;
+                    start_timer(&conn->read_timer, conn->read_timeout);
+                    return;
+                }
+            }
+        }
+
+        /* success: send read bytes to coroutine that is waiting */
         lua_rawgeti(l_global, LUA_REGISTRYINDEX, resume_thread_fn_ref);
         lua_pushinteger(l_global, conn->lua_reader_tid);
         lua_pushboolean(l_global, 1);
-        lua_pushlstring(l_global, conn->read_buffer, (conn->read_len + nread));
+        lua_pushlstring(l_global, conn->read_buffer, len);
         conn->lua_reader_tid = 0;
         conn->read_len = 0L;
+        conn->request_start = false;
         resume_lua_thread(l_global, 3, 2, 0);
         return;
     }
 
+    if ((conn->lua_reader_tid == 0)&&(conn->read_len > 0)) {
+        /* buffered data goes to the next conn:read() first, EOF or error is reported after it */
+        conn->read_end_status = nread;
+        uv_read_stop(stream);
+        return;
+    }
+
     /* either EOF or read error, in either case close connection */
     close_connection(conn, nread);
 }
@@ -264,44 +414,91 @@ LUA_OBJ_METHOD static int start_reading(lua_State *l_thread) {
     return 1;
 }
 
-/* Returns
+/* lua call spec: conn:read(tid, readTimeout, requestStart)
+* requestStart = true tells that the reader waits for a new HTTP request, which lets requests for
+* static routes be answered without waking it up.
+* Returns
 * 1. status: true for success or no data, false for error
 * 2. str: read string for successful read, NULL if no data, error message for failure
 */
 LUA_OBJ_METHOD static int read_check(lua_State* l_thread) {
     LUA_GET_CONN_OR_ERROR(l_thread, 1, conn);
 
-    if (!uv_is_active((uv_handle_t*)&conn->handle)) {
-        close_connection(conn, UV_EAI_BADFLAGS);
-       return error_to_lua(l_thread, "read() called on conn that is not registered to receive read events");
+    conn->request_start = lua_toboolean(l_thread, 4);
+    if ((conn->request_start)&&(conn->read_len > 0)) {
+        /* requests buffered while no coroutine was waiting */
+        size_t served = serve_static_routes(conn, conn->read_buffer, conn->read_len);
+        if (conn->lua_ref == NULL) return error_to_lua(l_thread, "EOF");
+        if (served > 0) {
+            conn->read_len -= served;
+            memmove(conn->read_buffer, conn->read_buffer + served, conn->read_len);
+            if ((conn->read_len == 0)&&(conn->read_paused)&&(conn->read_end_status == 0)) {
+                conn->read_paused = false;
+                int err_code = uv_read_start((uv_stream_t*)&conn->handle, on_alloc, on_read);
+                if (err_code) {
+                    close_connection(conn, err_code);
+                    return error_to_lua(l_thread, "%s", uv_strerror(err_code));
+                }
+            }
+        }
     }
 
-    if (conn->read_len == 0) {
-        /* empty buffer, record reader tid and block (yield) in lua */
-        int lua_reader_tid = lua_tointeger(l_thread, 2);
-        if (lua_reader_tid == 0) {
-            return error_to_lua(l_thread, "read() specified invalid thread id");
+    if (conn->read_len > 0) {
+        conn->request_start = false;
+        /* data buffered while no coroutine was waiting */
+        lua_pushboolean(l_thread, 1);
+        lua_pushlstring(l_thread, conn->read_buffer, conn->read_len);
+        conn->read_len = 0;
+
+        if ((conn->read_paused)&&(conn->read_end_status == 0)) {
+            conn->read_paused = false;
+            int err_code = uv_read_start((uv_stream_t*)&conn->handle, on_alloc, on_read);
+            if (err_code) {
+                close_connection(conn, err_code);
+            }
         }
+        return 2;
+    }
 
-        conn->lua_reader_tid = lua_reader_tid;
-        int readTimeout = lua_tointeger(l_thread, 3);
-        start_timer(&conn->read_timer, readTimeout);
+    if (conn->read_end_status != 0) {
+        /* all data buffered before EOF or error has been read */
+        int status = conn->read_end_status;
+        close_connection(conn, status);
+        return error_to_lua(l_thread, "%s", (status == UV_EOF) ? "EOF" : uv_strerror(status));
+    }
 
-        lua_pushboolean(l_thread, 1);
-        lua_pushnil(l_thread);
-        return 2;
+    if (!uv_is_active((uv_handle_t*)&conn->handle)) {
+        close_connection(conn, UV_EAI_BADFLAGS);
+       return error_to_lua(l_thread, "read() called on conn that is not registered to receive read events");
+    }
+
+    /* empty buffer, record reader tid and block (yield) in lua */
+    int lua_reader_tid = lua_tointeger(l_thread, 2);
+    if (lua_reader_tid == 0) {
+        return error_to_lua(l_thread, "read() specified invalid thread id");
     }
 
-    /* data available in buffer */
+    conn->lua_reader_tid = lua_reader_tid;
+    conn->read_timeout = lua_tointeger(l_thread, 3);
+    start_timer(&conn->read_timer, conn->read_timeout);
+
     lua_pushboolean(l_thread, 1);
-    lua_pushlstring(l_thread, conn->read_buffer, conn->read_len);
+    lua_pushnil(l_thread);
     return 2;
 }
 
+/* lua call spec: conn:isOpen() */
+LUA_OBJ_METHOD static int is_open(lua_State* l_thread) {
+    connection_t** cr = luaL_checkudata(l_thread, 1, LUA_CONNECTION_META_TABLE);
+    lua_pushboolean(l_thread, ((cr != NULL)&&(*cr != NULL)));
+    return 1;
+}
+
 LIBUV_API static void on_write(uv_write_t* req, int status) {
     connection_t* conn = TO_CONN(req);
     if(conn) {
         req->data = NULL;
+        conn->out_len = 0;
         if (status) {
             close_connection(conn, status);
         } else {
@@ -319,9 +516,15 @@ LIBUV_API static void on_write(uv_write_t* req, int status) {
     }
 }
 
-/* lua call spec: conn:write(tid, str, writeTimeout)
+static char CHUNK_END[] = "\r\n";
+static char LAST_CHUNK[] = "0\r\n\r\n";
+
+/* lua call spec: conn:write(tid, str, writeTimeout, chunked, lastChunk), str can be a string or a buffer
 Success: status(true), nwritten
 Failure: status(false), error message
+HTTP message head serialized in the connection's output buffer, if any, is written ahead of str.
+If chunked is true str is framed as a HTTP chunk, size line and trailing CRLF are written from their
+own buffers so that str is never copied. lastChunk adds terminating zero length chunk after it.
 */
 LUA_OBJ_METHOD static int write_buffer(lua_State* l_thread) {
     LUA_GET_CONN_OR_ERROR(l_thread, 1, conn);
@@ -333,17 +536,46 @@ LUA_OBJ_METHOD static int write_buffer(lua_State* l_thread) {
 
     size_t len = 0;
     const char* buff = lua_tolstring(l_thread, 3, &len);
+    luaw_buffer_t* buffer = to_buffer(l_thread, 3);
+    if (buffer != NULL) {
+        /* written in place, writer thread keeps buffer alive and untouched till the write completes */
+        buff = buffer->base;
+        len = buffer->len;
+    }
+    bool chunked = lua_toboolean(l_thread, 5);
+    bool last_chunk = ((chunked)&&(lua_toboolean(l_thread, 6)));
+
+    uv_buf_t write_buffs[5];
+    unsigned int nbufs = 0;
+    if (conn->out_len > 0) {
+        write_buffs[nbufs++] = uv_buf_init(conn->out_buffer, conn->out_len);
+    }
+    if (len > 0) {
+        if (chunked) {
+            int prefix_len = snprintf(conn->chunk_prefix, sizeof(conn->chunk_prefix), "%zx\r\n", len);
+            write_buffs[nbufs++] = uv_buf_init(conn->chunk_prefix, prefix_len);
+            write_buffs[nbufs++] = uv_buf_init((char*) buff, len);
+            write_buffs[nbufs++] = uv_buf_init(CHUNK_END, 2);
+        } else {
+            write_buffs[nbufs++] = uv_buf_init((char*) buff, len);
+        }
+    }
+    if (last_chunk) {
+        write_buffs[nbufs++] = uv_buf_init(LAST_CHUNK, 5);
+    }
+
+    len = 0;
+    for (unsigned int i = 0; i < nbufs; i++) {
+        len += write_buffs[i].len;
+    }
 
     if (len > 0) {
         /* non empty write buffer. Send write request, record writer tid and block in lua */
         int writeTimeout = lua_tointeger(l_thread, 4);
 
-        uv_buf_t write_buff;
-        write_buff.base = (char*) buff;
-        write_buff.len = len;
-
-        int err_code = uv_write(&conn->write_req, (uv_stream_t*)&conn->handle, &write_buff, 1, on_write);
+        int err_code = uv_write(&conn->write_req, (uv_stream_t*)&conn->handle, write_buffs, nbufs, on_write);
         if (err_code) {
+            conn->out_len = 0;
             close_connection(conn, err_code);
             lua_pushboolean(l_thread, 0);
             lua_pushstring(l_thread,  uv_strerror(err_code));
@@ -369,6 +601,7 @@ LIBUV_CALLBACK static void on_client_connect(uv_connect_t* connect_req, int stat
 
     lua_rawgeti(l_global, LUA_REGISTRYINDEX, resume_thread_fn_ref);
     lua_pushinteger(l_global, conn->lua_writer_tid);
+    conn->lua_writer_tid = 0;
 
     if (status) {
         close_connection(conn, status);
@@ -497,6 +730,8 @@ static const struct luaL_Reg luaw_connection_methods[] = {
 	{"read", read_check},
 	{"write", write_buffer},
 	{"close", close_connection_lua},
+	{"lingerClose", linger_close_lua},
+	{"isOpen", is_open},
 	{"__gc", connection_gc},
 	{NULL, NULL}  /* sentinel */
 };
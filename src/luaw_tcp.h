@@ -26,6 +26,7 @@
 
 #define LUA_CONNECTION_META_TABLE "_luaw_connection_MT_"
 #define CONN_BUFFER_SIZE 4096
+#define LINGER_TIMEOUT 2000     /* ms to keep discarding input after rejecting a request */
 
 typedef struct connection_s connection_t;
 
@@ -37,6 +38,11 @@ struct connection_s {
     /* read section */
     int lua_reader_tid;                     /* ID of the reading coroutine */
 	size_t read_len;			            /* read length */
+    bool read_paused;                       /* reading stopped because buffer is full */
+    int read_end_status;                    /* EOF or error seen while data was still buffered, 0 if none */
+    bool request_start;                     /* reader waits for the start of a new HTTP request */
+    bool lingering;                         /* write side shut down, input discarded till peer closes */
+    int read_timeout;                       /* timeout of the pending read */
     uv_timer_t read_timer;                  /* for read timeout */
 
     /* write section */
@@ -50,6 +56,11 @@ struct connection_s {
 
     /* read buffer */
     char read_buffer[CONN_BUFFER_SIZE];     /* buffer to read into */
+
+    /* write buffer */
+    size_t out_len;                         /* serialized HTTP message head waiting to be written */
+    char out_buffer[CONN_BUFFER_SIZE];      /* sent ahead of the next write's content in the same write request */
+    char chunk_prefix[24];                  /* hex size line of the chunk being written in chunked encoding */
 };
 
 #define MAX_CONNECTION_BUFF_SIZE 65536  //16^4
@@ -78,6 +89,10 @@ struct connection_s {
 /* TCP lib methods to be exported */
 extern connection_t* new_connection(lua_State* L);
 extern void close_connection(connection_t* conn, const int status);
+extern connection_t* to_connection(lua_State* L, int idx);
+extern void reject_connection(connection_t* conn, const char* response, size_t len);
+extern void linger_close(connection_t* conn);
+extern char* reserve_output(connection_t* conn);
 extern void luaw_init_tcp_lib (lua_State *L);
 
 #endif
@@ -191,15 +191,18 @@ LUA_OBJ_METHOD static int wait_user_timer(lua_State* l_thread) {
 LUA_OBJ_METHOD static int stop_user_timer(lua_State* l_thread) {
     LUA_GET_TIMER_OR_ERROR(l_thread, 1, timer);
     if (timer->state == TICKING) {
-        if (timer->lua_tid) {
+        /* reset timer before resuming waiting thread as it may want to reuse the timer */
+        int lua_tid = timer->lua_tid;
+        clear_user_timer(timer);
+        uv_timer_stop(&timer->handle);
+
+        if (lua_tid) {
             lua_rawgeti(l_thread, LUA_REGISTRYINDEX, resume_thread_fn_ref);
-            lua_pushinteger(l_thread, timer->lua_tid);
+            lua_pushinteger(l_thread, lua_tid);
             lua_pushboolean(l_thread, 0);                           //status
             lua_pushstring(l_thread, uv_strerror(UV_ECANCELED));    //error message
             resume_lua_thread(l_thread, 3, 2, 0);
         }
-        clear_user_timer(timer);
-        uv_timer_stop(&timer->handle);
     }
     return 0;
 }
@@ -0,0 +1,123 @@
+--[[
+Copyright (c) 2015 raksoras
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+]]
+
+-- Redis client tests against a fake connection, scheduler is replaced by one that runs user threads
+-- right away so that no event loop is needed
+
+local t = require('unit_testing')
+
+local written, replies, timeouts
+
+local fakeConn = {
+    startReading = function(self) end,
+    isOpen = function(self) return true end,
+    close = function(self) end,
+    write = function(self, str, writeTimeout)
+        table.insert(timeouts, writeTimeout)
+        table.insert(written, str)
+        return #str
+    end,
+    read = function(self, readTimeout)
+        table.insert(timeouts, readTimeout)
+        return true, table.remove(replies, 1)
+    end
+}
+
+package.loaded['luaw_scheduler'] = {
+    threadCtx = function() return {} end,
+    wakeUp = function(threadCtx) end,
+    suspend = function() error("fake scheduler can not suspend") end,
+    startUserThread = function(fn, ...) fn(...) end
+}
+package.loaded['luaw_tcp'] = {
+    connect = function(hostIP, hostName, port, connectTimeout) return fakeConn end
+}
+package.loaded['luaw_redis'] = nil
+
+local redis = require('luaw_redis')
+
+local function reset(...)
+    written, timeouts, replies = {}, {}, {...}
+end
+
+function t.testUnsetConfigIsNil()
+    local client = redis.newClient({hostIP = "127.0.0.1"})
+    t.assertNil(client.db)
+    t.assertNil(client.password)
+    t.assertNil(client.username)
+    t.assertNil(client.readTimeout)
+    t.assertNil(client.writeTimeout)
+    t.assertNil(client.connectTimeout)
+    t.assertEqual(client.port, 6379)
+    t.assertEqual(type(client.get), 'function')
+end
+
+function t.testConnectWithEmptyConfig()
+    reset("+PONG\r\n")
+    local client = redis.newClient({hostIP = "127.0.0.1"})
+    local reply, err = client:ping()
+    t.assertNil(err)
+    t.assertEqual(reply, "PONG")
+    -- no AUTH or SELECT handshake, just the command itself
+    t.assertEqual(#written, 1)
+    t.assertEqual(written[1], redis.encodeCommand("PING"))
+    for i, timeout in pairs(timeouts) do
+        t.assertEqual(type(timeout), 'nil')
+    end
+    client:close()
+end
+
+function t.testConnectWithDbAndPassword()
+    reset("+OK\r\n", "+OK\r\n", "$1\r\nv\r\n")
+    local client = redis.newClient({hostIP = "127.0.0.1", password = "secret", db = 2})
+    t.assertEqual(client:get("k"), "v")
+    t.assertEqual(table.concat(written), redis.encodeCommand("AUTH", "secret")..
+        redis.encodeCommand("SELECT", 2)..redis.encodeCommand("GET", "k"))
+    client:close()
+end
+
+function t.testReplySplitAcrossReads()
+    local value = string.rep("x", 10000)
+    local reply = "*2\r\n$"..#value.."\r\n"..value.."\r\n:42\r\n"
+    reset()
+    for i = 1, #reply, 1000 do
+        table.insert(replies, string.sub(reply, i, i + 999))
+    end
+    local client = redis.newClient({hostIP = "127.0.0.1"})
+    local result = client:call("MGET", "a", "b")
+    t.assertEqual(#replies, 0)
+    t.assertEqual(result[1], value)
+    t.assertEqual(result[2], 42)
+    client:close()
+end
+
+function t.testRunOfAttributesBeforeReply()
+    reset(string.rep("|0\r\n", 200000).."|1\r\n+ttl\r\n:10\r\n_\r\n")
+    local client = redis.newClient({hostIP = "127.0.0.1"})
+    -- attributes are dropped, null reply following them is still a top level nil
+    local reply, err = client:get("k")
+    t.assertNil(reply)
+    t.assertNil(err)
+    client:close()
+end
+
+t:runTests()
@@ -0,0 +1,161 @@
+--[[
+Copyright (c) 2015 raksoras
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+]]
+
+--[[ Static routes served straight from C, tested against a running server. Run from the root of the
+repository with the server built in src:
+
+    src/luaw_server test/luaw_static_routes.cfg test/luaw_static_routes_test.lua
+
+Server loads the webapp in test/webapps/statictest, tests run on a user thread once the server is up
+and the server exits with non zero status if any of them failed.
+]]
+
+local t = require('unit_testing')
+
+local PORT = luaw_server_config.server_port
+local HEALTH = "GET /statictest/health HTTP/1.1\r\nHost: localhost\r\n\r\n"
+
+-- C's copy of the static route gets a body of its own, which tells the responses written by C apart
+-- from the ones of the route's Lua handler
+luaw_http_lib.addStaticRoute('GET', '/statictest/health', {status = 200, headers = {['Content-Length'] = 1}, body = 'C'})
+
+local function connect()
+    local conn = luaw_tcp_lib.connect('127.0.0.1', nil, PORT, 2000)
+    conn:startReading()
+    return conn
+end
+
+local function sleep(timeout)
+    local timer = luaw_timer_lib.newTimer()
+    timer:sleep(timeout)
+    timer:delete()
+end
+
+-- Reads till count complete responses have arrived. Each response is returned as a table with
+-- status, connection header and body
+local function readResponses(conn, count)
+    local responses, buffered = {}, ''
+    while (#responses < count) do
+        local resp
+        local headEnd = string.find(buffered, "\r\n\r\n", 1, true)
+        if (headEnd) then
+            local head = string.sub(buffered, 1, headEnd + 1)
+            local length = tonumber(string.match(head, "\r\n[Cc]ontent%-[Ll]ength: *(%d+)")) or 0
+            local bodyEnd = headEnd + 3 + length
+            if (#buffered >= bodyEnd) then
+                resp = {
+                    status = tonumber(string.match(head, "^HTTP/1%.%d (%d+)")),
+                    connection = string.match(head, "\r\n[Cc]onnection: *([^\r]+)"),
+                    body = string.sub(buffered, headEnd + 4, bodyEnd)
+                }
+                table.insert(responses, resp)
+                buffered = string.sub(buffered, bodyEnd + 1)
+            end
+        end
+        if (not resp) then
+            local status, str = conn:read(2000)
+            assert(status, str)
+            buffered = buffered..str
+        end
+    end
+    t.assertEqual(buffered, '')
+    return responses
+end
+
+-- nothing but the responses already read should ever arrive
+local function assertNoMoreResponses(conn)
+    local status, str = conn:read(300)
+    t.assertFalse(status)
+    conn:close()
+end
+
+local function assertServedByC(resp)
+    t.assertEqual(resp.status, 200)
+    t.assertEqual(resp.body, 'C')
+end
+
+local function assertServedByLua(resp)
+    t.assertEqual(resp.status, 200)
+    t.assertEqual(resp.body, 'OK')
+end
+
+function t.testStaticRouteServedFromC()
+    local conn = connect()
+    conn:write(HEALTH)
+    assertServedByC(readResponses(conn, 1)[1])
+    conn:write(HEALTH)
+    assertServedByC(readResponses(conn, 1)[1])
+    assertNoMoreResponses(conn)
+end
+
+function t.testHttp10FallsBackToLua()
+    local conn = connect()
+    conn:write("GET /statictest/health HTTP/1.0\r\n\r\n")
+    assertServedByLua(readResponses(conn, 1)[1])
+    assertNoMoreResponses(conn)
+end
+
+function t.testConnectionCloseFallsBackToLua()
+    local conn = connect()
+    conn:write("GET /statictest/health HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n")
+    local resp = readResponses(conn, 1)[1]
+    assertServedByLua(resp)
+    t.assertEqual(resp.connection, 'close')
+    assertNoMoreResponses(conn)
+end
+
+function t.testQueryStringFallsBackToLua()
+    local conn = connect()
+    conn:write("GET /statictest/health?verbose=1 HTTP/1.1\r\nHost: localhost\r\n\r\n")
+    assertServedByLua(readResponses(conn, 1)[1])
+    assertNoMoreResponses(conn)
+end
+
+function t.testPipelinedStaticRequestsWaitForHandler()
+    local conn = connect()
+    conn:write("GET /statictest/slow HTTP/1.1\r\nHost: localhost\r\n\r\n")
+    -- static requests arrive while the handler of the first request is still running
+    sleep(50)
+    conn:write(HEALTH..HEALTH)
+    local responses = readResponses(conn, 3)
+    t.assertEqual(responses[1].body, 'slow')
+    assertServedByC(responses[2])
+    assertServedByC(responses[3])
+    assertNoMoreResponses(conn)
+end
+
+function t.testBodyIsNeverTakenForStaticRequest()
+    local conn = connect()
+    conn:write("POST /statictest/echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: "..#HEALTH.."\r\n\r\n")
+    -- make the body arrive in a read of its own
+    sleep(100)
+    conn:write(HEALTH)
+    local resp = readResponses(conn, 1)[1]
+    t.assertEqual(resp.status, 200)
+    t.assertEqual(resp.body, HEALTH)
+    assertNoMoreResponses(conn)
+end
+
+luaw_scheduler.startUserThread(function()
+    t:runTests()
+    os.exit((t.total_failed == 0) and 0 or 1)
+end)
@@ -0,0 +1,27 @@
+registerStaticHandler {
+    method = 'GET',
+    path = 'health',
+    headers = { ['Content-Type'] = 'text/plain' },
+    body = 'OK'
+}
+
+registerHandler {
+    method = 'POST',
+    path = 'echo',
+
+    handler = function(req, resp, pathParams)
+        return req.body
+    end
+}
+
+registerHandler {
+    method = 'GET',
+    path = 'slow',
+
+    handler = function(req, resp, pathParams)
+        local timer = luaw_timer_lib.newTimer()
+        timer:sleep(200)
+        timer:delete()
+        return "slow"
+    end
+}
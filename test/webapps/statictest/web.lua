@@ -0,0 +1,3 @@
+luaw_webapp = {
+    resourcePattern = "handler%-.*%.lua"
+}